@@ -0,0 +1,109 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "host/ble_hs.h"
+#include "adv_payload.h"
+
+void
+adv_payload_init(struct adv_payload *ap)
+{
+    ap->ap_len = 0;
+    ap->ap_sent_valid = 0;
+}
+
+/**
+ * Replaces the payload with the host's encoding of the given fields.  Any
+ * automatic values, such as the TX power level, are resolved here, once.
+ */
+int
+adv_payload_set_fields(struct adv_payload *ap,
+                       const struct ble_hs_adv_fields *fields)
+{
+    return ble_hs_adv_set_fields(fields, ap->ap_data, &ap->ap_len,
+                                 sizeof ap->ap_data);
+}
+
+/**
+ * Appends an AD structure.
+ *
+ * @return                      The offset of the structure's data within
+ *                                  the payload, for adv_payload_patch();
+ *                              -1 if it does not fit.
+ */
+int
+adv_payload_add(struct adv_payload *ap, uint8_t type, const void *data,
+                uint8_t len)
+{
+    int off;
+
+    if (ap->ap_len + 2 + len > sizeof ap->ap_data) {
+        return -1;
+    }
+
+    ap->ap_data[ap->ap_len++] = len + 1;
+    ap->ap_data[ap->ap_len++] = type;
+    off = ap->ap_len;
+    if (data != NULL) {
+        memcpy(ap->ap_data + off, data, len);
+    } else {
+        memset(ap->ap_data + off, 0, len);
+    }
+    ap->ap_len += len;
+
+    return off;
+}
+
+void
+adv_payload_patch(struct adv_payload *ap, int off, const void *data,
+                  uint8_t len)
+{
+    assert(off >= 0 && off + len <= ap->ap_len);
+    memcpy(ap->ap_data + off, data, len);
+}
+
+/**
+ * Sends the payload if it differs from the last one sent.
+ *
+ * @return                      0 if the controller has the payload;
+ *                              the transmit function's error otherwise.
+ */
+int
+adv_payload_commit(struct adv_payload *ap, adv_payload_tx_fn *tx, void *arg)
+{
+    int rc;
+
+    if (ap->ap_sent_valid && ap->ap_sent_len == ap->ap_len &&
+        memcmp(ap->ap_sent, ap->ap_data, ap->ap_len) == 0) {
+
+        return 0;
+    }
+
+    rc = tx(ap->ap_data, ap->ap_len, arg);
+    if (rc != 0) {
+        ap->ap_sent_valid = 0;
+        return rc;
+    }
+
+    memcpy(ap->ap_sent, ap->ap_data, ap->ap_len);
+    ap->ap_sent_len = ap->ap_len;
+    ap->ap_sent_valid = 1;
+    return 0;
+}
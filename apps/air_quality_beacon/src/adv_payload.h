@@ -0,0 +1,63 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+*/
+
+#ifndef H_ADV_PAYLOAD_
+#define H_ADV_PAYLOAD_
+
+#include <inttypes.h>
+#include "host/ble_hs.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Advertising data that is encoded once and then patched in place.  The
+ * static AD structures are built up front; adv_payload_add() returns the
+ * offset of the bytes that change (readings, counters, TX power), which
+ * are later overwritten directly.  adv_payload_commit() hands the data to the
+ * controller only when it differs from what was last sent.
+ */
+struct adv_payload {
+    uint8_t ap_data[BLE_HCI_MAX_ADV_DATA_LEN];
+    uint8_t ap_len;
+
+    /* Private; copy of what the controller has. */
+    uint8_t ap_sent[BLE_HCI_MAX_ADV_DATA_LEN];
+    uint8_t ap_sent_len;
+    uint8_t ap_sent_valid;
+};
+
+/** Sends advertising data to the controller. */
+typedef int adv_payload_tx_fn(const uint8_t *data, uint8_t len, void *arg);
+
+void adv_payload_init(struct adv_payload *ap);
+int adv_payload_set_fields(struct adv_payload *ap,
+                           const struct ble_hs_adv_fields *fields);
+int adv_payload_add(struct adv_payload *ap, uint8_t type, const void *data,
+                    uint8_t len);
+void adv_payload_patch(struct adv_payload *ap, int off, const void *data,
+                       uint8_t len);
+int adv_payload_commit(struct adv_payload *ap, adv_payload_tx_fn *tx,
+                       void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
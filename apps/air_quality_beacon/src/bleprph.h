@@ -20,6 +20,7 @@
 #ifndef H_BLEPRPH_
 #define H_BLEPRPH_
 
+#include "syscfg/syscfg.h"
 #include "host/ble_uuid.h"
 #include "log/log.h"
 #ifdef __cplusplus
@@ -34,9 +35,22 @@ extern struct log bleprph_log;
 /* bleprph uses the first "peruser" log module. */
 #define BLEPRPH_LOG_MODULE  (LOG_MODULE_PERUSER + 0)
 
-/* Convenience macro for logging to the bleprph module. */
+/*
+ * Convenience macro for logging to the bleprph module.  Messages below
+ * BLEPRPH_LOG_LEVEL, or below the system-wide LOG_LEVEL if that is higher,
+ * are compiled out: the call sits behind if (0), so its arguments are
+ * still type-checked but neither evaluated nor, with the format string,
+ * kept in the image.
+ */
 #define BLEPRPH_LOG(lvl, ...) \
-    LOG_ ## lvl(&bleprph_log, BLEPRPH_LOG_MODULE, __VA_ARGS__)
+    BLEPRPH_LOG_AT(LOG_LEVEL_ ## lvl, __VA_ARGS__)
+
+#define BLEPRPH_LOG_AT(lvl, ...) do {                                       \
+    if ((lvl) >= MYNEWT_VAL(BLEPRPH_LOG_LEVEL) &&                           \
+        (lvl) >= MYNEWT_VAL(LOG_LEVEL)) {                                   \
+        log_printf(&bleprph_log, BLEPRPH_LOG_MODULE, (lvl), __VA_ARGS__);   \
+    }                                                                       \
+} while (0)
 
 /** GATT server. */
 #define GATT_SVR_SVC_ALERT_UUID               0x1811
@@ -55,14 +69,51 @@ static const ble_uuid128_t gatt_svr_svc_co2_uuid =
 #define CO2_SNS_STRING "SenseAir K30 CO2 Sensor"
 #define CO2_SNS_VAL               0xBEAD
 
+/* Sample history download; see gatt_svr.c for the protocol. */
+#define HISTORY_VAL             0xBEAE
+#define HISTORY_CTRL            0xBEAF
+
+/* Environmental Sensing descriptors on the sensor value characteristics. */
+#define GATT_SVR_DSC_ES_CONFIG      0x290B
+#define GATT_SVR_DSC_ES_TRIGGER     0x290D
+#define GATT_SVR_SNS_TRIG_CNT       3
+
+/* ES Trigger Setting conditions. */
+#define GATT_SVR_TRIG_INACTIVE      0x00
+#define GATT_SVR_TRIG_FIXED_ITVL    0x01
+#define GATT_SVR_TRIG_MIN_ITVL      0x02
+#define GATT_SVR_TRIG_CHANGED       0x03
+#define GATT_SVR_TRIG_LT            0x04
+#define GATT_SVR_TRIG_LE            0x05
+#define GATT_SVR_TRIG_GT            0x06
+#define GATT_SVR_TRIG_GE            0x07
+#define GATT_SVR_TRIG_EQ            0x08
+#define GATT_SVR_TRIG_NE            0x09
+
+/* ES Configuration values. */
+#define GATT_SVR_ES_CONFIG_OR       0x00
+#define GATT_SVR_ES_CONFIG_AND      0x01
+
+/* Environmental Sensing Service application errors. */
+#define GATT_SVR_ATT_ERR_WRITE_REJECTED     0x80
+#define GATT_SVR_ATT_ERR_COND_UNSUPPORTED   0x81
+
 uint16_t gatt_co2_val; 
 
+/* Sensor characteristics whose values get notified. */
+enum gatt_svr_sns {
+    GATT_SVR_SNS_CO2,
+    GATT_SVR_SNS_CNT
+};
+
 void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
 int gatt_svr_init(void);
-
-/** Misc. */
-void print_bytes(const uint8_t *bytes, int len);
-void print_addr(const void *addr);
+uint16_t gatt_svr_sns_val_handle(enum gatt_svr_sns sns);
+void gatt_svr_notify_tx(uint16_t conn_handle, uint16_t attr_handle);
+int gatt_svr_subscribe(uint16_t conn_handle, uint16_t attr_handle, int on);
+void gatt_svr_conn_broken(uint16_t conn_handle);
+int gatt_svr_sns_subscribers(enum gatt_svr_sns sns);
+int gatt_svr_sns_triggered(enum gatt_svr_sns sns, uint16_t val);
 
 #ifdef __cplusplus
 }
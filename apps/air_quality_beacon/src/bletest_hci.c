@@ -344,7 +344,8 @@ bletest_hci_le_read_supp_states(void)
 }
 
 int
-bletest_hci_le_rd_max_datalen(void)
+bletest_hci_le_rd_max_datalen(uint16_t *max_tx_octets, uint16_t *max_tx_time,
+                              uint16_t *max_rx_octets, uint16_t *max_rx_time)
 {
     int rc;
     uint8_t buf[BLE_HCI_CMD_HDR_LEN];
@@ -360,6 +361,19 @@ bletest_hci_le_rd_max_datalen(void)
     if (rsplen != BLE_HCI_RD_MAX_DATALEN_RSPLEN) {
         return BLE_HS_ECONTROLLER;
     }
+
+    if (max_tx_octets != NULL) {
+        *max_tx_octets = get_le16(rspbuf);
+    }
+    if (max_tx_time != NULL) {
+        *max_tx_time = get_le16(rspbuf + 2);
+    }
+    if (max_rx_octets != NULL) {
+        *max_rx_octets = get_le16(rspbuf + 4);
+    }
+    if (max_rx_time != NULL) {
+        *max_rx_time = get_le16(rspbuf + 6);
+    }
     return rc;
 }
 
@@ -44,7 +44,10 @@ int bletest_hci_rd_local_version(void);
 int bletest_hci_rd_local_feat(void);
 int bletest_hci_rd_local_supp_cmd(void);
 int bletest_hci_le_read_supp_states(void);
-int bletest_hci_le_rd_max_datalen(void);
+int bletest_hci_le_rd_max_datalen(uint16_t *max_tx_octets,
+                                  uint16_t *max_tx_time,
+                                  uint16_t *max_rx_octets,
+                                  uint16_t *max_rx_time);
 int bletest_hci_le_read_rem_used_feat(uint16_t handle);
 int bletest_hci_le_set_rand_addr(uint8_t *addr);
 int bletest_hci_rd_rem_version(uint16_t handle);
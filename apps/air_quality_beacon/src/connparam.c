@@ -0,0 +1,404 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <assert.h>
+#include "os/os.h"
+#include "syscfg/syscfg.h"
+#include "nimble/hci_common.h"
+#include "host/ble_hs.h"
+#include "bleprph.h"
+#include "bletest_priv.h"
+#include "connparam.h"
+
+#define CONNPARAM_IDLE_TICKS \
+    ((os_time_t)((uint64_t)MYNEWT_VAL(AIRQ_CONN_IDLE_MS) * \
+                 OS_TICKS_PER_SEC / 1000))
+
+struct connparam_conn {
+    uint16_t cc_conn_handle;
+
+    /* Mode the link's parameters are in (none if they match neither), the
+     * one we want, and the one our update procedure in progress asked for.
+     */
+    uint8_t cc_cur;
+    uint8_t cc_want;
+    uint8_t cc_pend;
+
+    /* ATT payload per PDU: negotiated MTU less the ATT header. */
+    uint16_t cc_att_payload;
+
+    struct os_callout cc_idle_timer;
+};
+
+static struct connparam_conn connparam_conns[MYNEWT_VAL(BLE_MAX_CONNECTIONS)];
+
+/* Controller data length maxima; 0 if it does not support DLE. */
+static uint16_t connparam_max_tx_octets;
+static uint16_t connparam_max_tx_time;
+
+/* Set while a firmware upload is in progress: every connection stays on
+ * the bulk parameters.
+ */
+static int connparam_held;
+
+static const char *connparam_mode_names[] = {
+    [CONNPARAM_NONE] = "none",
+    [CONNPARAM_BULK] = "bulk",
+    [CONNPARAM_IDLE] = "idle",
+};
+
+static struct connparam_conn *
+connparam_find(uint16_t conn_handle)
+{
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        if (connparam_conns[i].cc_conn_handle == conn_handle) {
+            return &connparam_conns[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+connparam_fill(enum connparam_mode mode, struct ble_gap_upd_params *params)
+{
+    uint32_t tmo_ms;
+
+    if (mode == CONNPARAM_BULK) {
+        params->itvl_min = MYNEWT_VAL(AIRQ_CONN_BULK_ITVL_MIN);
+        params->itvl_max = MYNEWT_VAL(AIRQ_CONN_BULK_ITVL_MAX);
+        params->latency = 0;
+    } else {
+        params->itvl_min = MYNEWT_VAL(AIRQ_CONN_IDLE_ITVL_MIN);
+        params->itvl_max = MYNEWT_VAL(AIRQ_CONN_IDLE_ITVL_MAX);
+        params->latency = MYNEWT_VAL(AIRQ_CONN_IDLE_LATENCY);
+    }
+
+    /* Supervision timeout: three effective intervals, but at least 1 s so
+     * a few lost events on a short bulk interval do not drop the link, and
+     * at most the 32 s the spec allows.  Intervals are in 1.25 ms units,
+     * the timeout in 10 ms units.
+     */
+    tmo_ms = (1 + params->latency) * params->itvl_max * 5 / 4 * 3;
+    if (tmo_ms < 1000) {
+        tmo_ms = 1000;
+    }
+    if (tmo_ms > 32000) {
+        tmo_ms = 32000;
+    }
+    params->supervision_timeout = tmo_ms / 10;
+    params->min_ce_len = 0;
+    params->max_ce_len = 0;
+}
+
+/**
+ * Tells which mode a connection's parameters fall in: interval within the
+ * mode's range and the mode's slave latency.
+ */
+static enum connparam_mode
+connparam_mode_of(const struct ble_gap_conn_desc *desc)
+{
+    struct ble_gap_upd_params params;
+    enum connparam_mode mode;
+
+    for (mode = CONNPARAM_BULK; mode <= CONNPARAM_IDLE; mode++) {
+        connparam_fill(mode, &params);
+        if (desc->conn_itvl >= params.itvl_min &&
+            desc->conn_itvl <= params.itvl_max &&
+            desc->conn_latency == params.latency) {
+
+            return mode;
+        }
+    }
+    return CONNPARAM_NONE;
+}
+
+static void
+connparam_apply(struct connparam_conn *cc)
+{
+    struct ble_gap_upd_params params;
+    int rc;
+
+    if (cc->cc_pend != CONNPARAM_NONE || cc->cc_cur == cc->cc_want) {
+        return;
+    }
+
+    connparam_fill(cc->cc_want, &params);
+    rc = ble_gap_update_params(cc->cc_conn_handle, &params);
+    if (rc != 0) {
+        BLEPRPH_LOG(INFO, "conn param update failed; conn_handle=%d "
+                          "rc=%d\n", cc->cc_conn_handle, rc);
+        return;
+    }
+    cc->cc_pend = cc->cc_want;
+}
+
+static void
+connparam_idle_ev(struct os_event *ev)
+{
+    struct connparam_conn *cc;
+
+    cc = ev->ev_arg;
+    if (cc->cc_conn_handle == BLE_HS_CONN_HANDLE_NONE || connparam_held) {
+        return;
+    }
+    cc->cc_want = CONNPARAM_IDLE;
+    connparam_apply(cc);
+}
+
+/* Result of the MTU exchange we start on each new connection. */
+static int
+connparam_mtu_cb(uint16_t conn_handle, const struct ble_gatt_error *error,
+                 uint16_t mtu, void *arg)
+{
+    if (error->status == 0) {
+        connparam_mtu(conn_handle, mtu);
+    } else {
+        BLEPRPH_LOG(INFO, "mtu exchange failed; conn_handle=%d status=%d\n",
+                    conn_handle, error->status);
+    }
+    return 0;
+}
+
+/**
+ * Starts managing a new connection.  It keeps the parameters the central
+ * chose until it has been quiet for AIRQ_CONN_IDLE_MS, so discovery and
+ * setup run at the central's pace, unless an upload session holds every
+ * link on the bulk parameters.
+ */
+void
+connparam_connected(uint16_t conn_handle)
+{
+    struct connparam_conn *cc;
+    int rc;
+
+    cc = connparam_find(BLE_HS_CONN_HANDLE_NONE);
+    if (cc == NULL) {
+        return;
+    }
+    cc->cc_conn_handle = conn_handle;
+    cc->cc_cur = CONNPARAM_NONE;
+    cc->cc_want = CONNPARAM_NONE;
+    cc->cc_pend = CONNPARAM_NONE;
+    cc->cc_att_payload = BLE_ATT_MTU_DFLT - 3;
+    os_callout_reset(&cc->cc_idle_timer, CONNPARAM_IDLE_TICKS);
+    if (connparam_held) {
+        cc->cc_want = CONNPARAM_BULK;
+        connparam_apply(cc);
+    }
+
+    /* Large link layer PDUs, so a full ATT packet goes out in one. */
+    if (connparam_max_tx_octets > BLE_HCI_SET_DATALEN_TX_OCTETS_MIN) {
+        rc = bletest_hci_le_set_datalen(conn_handle, connparam_max_tx_octets,
+                                        connparam_max_tx_time);
+        if (rc != 0) {
+            BLEPRPH_LOG(INFO, "set data length failed; conn_handle=%d "
+                              "rc=%d\n", conn_handle, rc);
+        }
+    }
+
+    /* Ask for our preferred MTU rather than waiting for the central. */
+    rc = ble_gattc_exchange_mtu(conn_handle, connparam_mtu_cb, NULL);
+    if (rc != 0) {
+        BLEPRPH_LOG(INFO, "mtu exchange failed; conn_handle=%d rc=%d\n",
+                    conn_handle, rc);
+    }
+}
+
+void
+connparam_disconnected(uint16_t conn_handle)
+{
+    struct connparam_conn *cc;
+
+    cc = connparam_find(conn_handle);
+    if (cc == NULL) {
+        return;
+    }
+    os_callout_stop(&cc->cc_idle_timer);
+    cc->cc_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+}
+
+/**
+ * Notes GATT traffic on a connection: switches it to the bulk parameters
+ * and restarts its idle timer, so it only goes idle once it has been quiet
+ * for AIRQ_CONN_IDLE_MS.
+ */
+void
+connparam_activity(uint16_t conn_handle)
+{
+    struct connparam_conn *cc;
+
+    cc = connparam_find(conn_handle);
+    if (cc == NULL) {
+        return;
+    }
+    os_callout_reset(&cc->cc_idle_timer, CONNPARAM_IDLE_TICKS);
+    cc->cc_want = CONNPARAM_BULK;
+    connparam_apply(cc);
+}
+
+/**
+ * Keeps every connection, current and new, on the bulk parameters while
+ * on is set; when cleared, connections go idle after the usual quiet time.
+ */
+void
+connparam_hold(int on)
+{
+    struct connparam_conn *cc;
+    int i;
+
+    connparam_held = on;
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        cc = &connparam_conns[i];
+        if (cc->cc_conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+            continue;
+        }
+        os_callout_reset(&cc->cc_idle_timer, CONNPARAM_IDLE_TICKS);
+        if (on) {
+            cc->cc_want = CONNPARAM_BULK;
+            connparam_apply(cc);
+        }
+    }
+}
+
+/**
+ * Reports the outcome of a connection update procedure, ours or the
+ * central's.  The mode in effect is taken from the parameters the link
+ * actually got, so a request only counts as done if the central granted
+ * it.  The host ends our procedure on any update event for the link, so
+ * one from the central finishes it too.
+ */
+void
+connparam_updated(uint16_t conn_handle, int status)
+{
+    struct ble_gap_conn_desc desc;
+    struct connparam_conn *cc;
+    uint8_t pend;
+
+    cc = connparam_find(conn_handle);
+    if (cc == NULL) {
+        return;
+    }
+    pend = cc->cc_pend;
+    cc->cc_pend = CONNPARAM_NONE;
+
+    if (status == 0 && ble_gap_conn_find(conn_handle, &desc) == 0) {
+        cc->cc_cur = connparam_mode_of(&desc);
+        BLEPRPH_LOG(INFO, "conn params; conn_handle=%d mode=%s "
+                          "itvl=%d latency=%d timeout=%d\n",
+                    conn_handle, connparam_mode_names[cc->cc_cur],
+                    desc.conn_itvl, desc.conn_latency,
+                    desc.supervision_timeout);
+    } else {
+        BLEPRPH_LOG(INFO, "conn param update failed; conn_handle=%d "
+                          "status=%d\n", conn_handle, status);
+    }
+
+    if (pend == CONNPARAM_NONE) {
+        /* The central's own choice; leave it be until we next want a
+         * change.
+         */
+        return;
+    }
+    if (cc->cc_cur == pend) {
+        /* Granted; follow up if the wanted mode changed meanwhile. */
+        connparam_apply(cc);
+        return;
+    }
+
+    /* Rejected or overridden.  Bulk traffic asks again on its next burst;
+     * an idle link asks again after another quiet period.
+     */
+    if (cc->cc_want == CONNPARAM_IDLE) {
+        os_callout_reset(&cc->cc_idle_timer, CONNPARAM_IDLE_TICKS);
+    }
+}
+
+/**
+ * Records a new ATT MTU, whichever side started the exchange.
+ */
+void
+connparam_mtu(uint16_t conn_handle, uint16_t mtu)
+{
+    struct connparam_conn *cc;
+
+    cc = connparam_find(conn_handle);
+    if (cc == NULL) {
+        return;
+    }
+    cc->cc_att_payload = mtu - 3;
+    BLEPRPH_LOG(INFO, "att payload; conn_handle=%d len=%d\n", conn_handle,
+                cc->cc_att_payload);
+}
+
+/**
+ * Returns how many bytes of attribute value fit in one notification on a
+ * connection; 0 if it is not connected.
+ */
+uint16_t
+connparam_att_payload(uint16_t conn_handle)
+{
+    struct connparam_conn *cc;
+
+    cc = connparam_find(conn_handle);
+    if (cc == NULL) {
+        return 0;
+    }
+    return cc->cc_att_payload;
+}
+
+/**
+ * Reads the controller's data length maxima and makes them the default for
+ * new connections.  Called each time the host syncs with the controller.
+ */
+void
+connparam_sync(void)
+{
+    int rc;
+
+    rc = bletest_hci_le_rd_max_datalen(&connparam_max_tx_octets,
+                                       &connparam_max_tx_time, NULL, NULL);
+    if (rc != 0) {
+        BLEPRPH_LOG(INFO, "no data length extension; rc=%d\n", rc);
+        connparam_max_tx_octets = 0;
+        return;
+    }
+
+    rc = bletest_hci_le_write_sugg_datalen(connparam_max_tx_octets,
+                                           connparam_max_tx_time);
+    if (rc != 0) {
+        BLEPRPH_LOG(INFO, "write suggested data length failed; rc=%d\n",
+                    rc);
+    }
+}
+
+void
+connparam_init(void)
+{
+    struct connparam_conn *cc;
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        cc = &connparam_conns[i];
+        cc->cc_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        os_callout_init(&cc->cc_idle_timer, os_eventq_dflt_get(),
+                        connparam_idle_ev, cc);
+    }
+}
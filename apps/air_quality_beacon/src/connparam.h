@@ -0,0 +1,59 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+*/
+
+#ifndef H_CONNPARAM_
+#define H_CONNPARAM_
+
+#include <inttypes.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Connection parameter policy.  A connection is asked for a short interval
+ * and no slave latency while it carries GATT traffic (accesses to our
+ * characteristics, history downloads, newtmgr requests such as image
+ * uploads), and for a long interval with slave latency once it has been
+ * quiet for AIRQ_CONN_IDLE_MS.
+ *
+ * Each new link is also set up for large packets: data length extension up
+ * to the controller's maximum and an ATT MTU exchange.  The resulting ATT
+ * payload is published through connparam_att_payload().
+ */
+enum connparam_mode {
+    CONNPARAM_NONE,
+    CONNPARAM_BULK,
+    CONNPARAM_IDLE,
+};
+
+void connparam_init(void);
+void connparam_sync(void);
+void connparam_connected(uint16_t conn_handle);
+void connparam_disconnected(uint16_t conn_handle);
+void connparam_activity(uint16_t conn_handle);
+void connparam_hold(int on);
+void connparam_updated(uint16_t conn_handle, int status);
+void connparam_mtu(uint16_t conn_handle, uint16_t mtu);
+uint16_t connparam_att_payload(uint16_t conn_handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,11 +19,16 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "bsp/bsp.h"
+#include "syscfg/syscfg.h"
 #include "host/ble_hs.h"
 #include "host/ble_uuid.h"
 #include "bleprph.h"
+#include "history.h"
+#include "connparam.h"
+#include "upgrade.h"
 
 /**
  * The vendor specific security test service consists of two characteristics:
@@ -51,13 +56,129 @@ static const ble_uuid128_t gatt_svr_chr_sec_test_static_uuid =
 
 static uint8_t gatt_svr_sec_test_static_val;
 
+/* da2e7828-fbce-4e01-ae9e-261174997c48: the characteristic
+ * mgmt/newtmgr/transport/ble carries requests and responses on.
+ */
+static const ble_uuid128_t gatt_svr_chr_nmgr_uuid =
+    BLE_UUID128_INIT(0x48, 0x7c, 0x99, 0x74, 0x11, 0x26, 0x9e, 0xae,
+                     0x01, 0x4e, 0xce, 0xfb, 0x28, 0x78, 0x2e, 0xda);
+
+static uint16_t gatt_svr_nmgr_val_handle;
+
 static uint16_t gatt_co2_val_len;
 
+/* Value handles of the sensor characteristics; filled in by the host when
+ * the services are registered.
+ */
+static uint16_t gatt_svr_sns_val_handles[GATT_SVR_SNS_CNT];
+
+/* Which sensor characteristics each connection has notifications or
+ * indications enabled on, and how many connections are subscribed to each.
+ * The bit above the sensor ones stands for the history characteristic.
+ */
+#define GATT_SVR_SUB_F_HIST         (1 << GATT_SVR_SNS_CNT)
+
+struct gatt_svr_sub {
+    uint16_t conn_handle;
+    uint8_t sns_mask;
+};
+static struct gatt_svr_sub gatt_svr_subs[MYNEWT_VAL(BLE_MAX_CONNECTIONS)];
+static uint8_t gatt_svr_sns_sub_cnt[GATT_SVR_SNS_CNT];
+
+/* Notification triggers of a sensor characteristic, as configured through
+ * its ES Trigger Setting and ES Configuration descriptors.  Triggers are
+ * shared by all connections; the last notified value and time are what the
+ * triggers are evaluated against.
+ */
+struct gatt_svr_trig {
+    uint8_t cond;
+    uint32_t operand;
+};
+
+struct gatt_svr_sns_trig {
+    struct gatt_svr_trig trig[GATT_SVR_SNS_TRIG_CNT];
+    uint8_t config;
+    uint8_t cmp_state;
+    uint8_t cmp_valid;
+    uint8_t notified;
+    uint16_t last_val;
+    os_time_t last_time;
+};
+static struct gatt_svr_sns_trig gatt_svr_sns_trigs[GATT_SVR_SNS_CNT];
+
+/**
+ * Sample history download.  A central subscribes to the history
+ * characteristic and writes a request to the history control point:
+ *     o 0x01 <uint32 seq>: send the records from sequence number seq up to
+ *       the newest one held when the request arrived.
+ *     o 0x02: abort the transfer in progress.
+ *
+ * The records come back as notifications of the history characteristic,
+ * each one packed with as many records as the ATT MTU allows:
+ *     <uint32 now> <uint32 first seq> <uint8 count> count * <record>
+ * where a record is <uint32 time> <uint16 co2> <uint8 status>, times are in
+ * seconds since boot and now is the time the notification was built.  A
+ * notification with a count of 0 ends the transfer.  If records were
+ * overwritten before they could be sent, the first seq jumps ahead.
+ *
+ * Reading the control point returns <uint32 first> <uint32 next>
+ * <uint32 now>: the sequence number of the oldest record held, the one the
+ * next record will get, and the current time.
+ *
+ * All multi-byte fields are little-endian.  One transfer runs at a time,
+ * and only to a connection subscribed to the history characteristic.
+ */
+#define GATT_SVR_HIST_OP_SEND       0x01
+#define GATT_SVR_HIST_OP_ABORT      0x02
+#define GATT_SVR_HIST_HDR_LEN       9
+#define GATT_SVR_HIST_REC_LEN       7
+
+/* Notifications queued per event before yielding to other events. */
+#define GATT_SVR_HIST_BURST         4
+
+/* Delay before retrying after running out of mbufs. */
+#define GATT_SVR_HIST_RETRY_TICKS   (OS_TICKS_PER_SEC / 50 + 1)
+
+/* Error codes from the Client Characteristic Configuration Descriptor
+ * error range.
+ */
+#define GATT_SVR_ATT_ERR_CCCD_IMPROPER      0xFD
+#define GATT_SVR_ATT_ERR_IN_PROGRESS        0xFE
+
+static uint16_t gatt_svr_hist_val_handle;
+static uint16_t gatt_svr_hist_conn;
+static uint32_t gatt_svr_hist_seq;
+static uint32_t gatt_svr_hist_end;
+static struct os_callout gatt_svr_hist_timer;
+
+/* Descriptor access argument: sensor in the high byte, trigger index (or
+ * 0xff for the configuration descriptor) in the low byte.
+ */
+#define GATT_SVR_DSC_ARG(sns, idx)  ((void *)(uintptr_t)(((sns) << 8) | (idx)))
+#define GATT_SVR_DSC_ARG_CONFIG     0xff
+
+#define GATT_SVR_DSC_TRIG(sns, idx) {                           \
+    .uuid = BLE_UUID16_DECLARE(GATT_SVR_DSC_ES_TRIGGER),        \
+    .att_flags = BLE_ATT_F_READ | BLE_ATT_F_WRITE,              \
+    .access_cb = gatt_svr_sns_dsc_access,                       \
+    .arg = GATT_SVR_DSC_ARG(sns, idx),                          \
+}
+
 static int
 gatt_svr_sns_access(uint16_t conn_handle, uint16_t attr_handle,
     struct ble_gatt_access_ctxt *ctxt,
     void *arg);
 
+static int
+gatt_svr_sns_dsc_access(uint16_t conn_handle, uint16_t attr_handle,
+                        struct ble_gatt_access_ctxt *ctxt,
+                        void *arg);
+
+static int
+gatt_svr_hist_access(uint16_t conn_handle, uint16_t attr_handle,
+                     struct ble_gatt_access_ctxt *ctxt,
+                     void *arg);
+
 static int
 gatt_svr_chr_access_sec_test(uint16_t conn_handle, uint16_t attr_handle,
                              struct ble_gatt_access_ctxt *ctxt,
@@ -94,7 +215,31 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
         }, {
             .uuid = BLE_UUID16_DECLARE(CO2_SNS_VAL),
             .access_cb = gatt_svr_sns_access,
+            .val_handle = &gatt_svr_sns_val_handles[GATT_SVR_SNS_CO2],
             .flags = BLE_GATT_CHR_F_NOTIFY,
+            .descriptors = (struct ble_gatt_dsc_def[]) {
+                GATT_SVR_DSC_TRIG(GATT_SVR_SNS_CO2, 0),
+                GATT_SVR_DSC_TRIG(GATT_SVR_SNS_CO2, 1),
+                GATT_SVR_DSC_TRIG(GATT_SVR_SNS_CO2, 2),
+                {
+                    .uuid = BLE_UUID16_DECLARE(GATT_SVR_DSC_ES_CONFIG),
+                    .att_flags = BLE_ATT_F_READ | BLE_ATT_F_WRITE,
+                    .access_cb = gatt_svr_sns_dsc_access,
+                    .arg = GATT_SVR_DSC_ARG(GATT_SVR_SNS_CO2,
+                                            GATT_SVR_DSC_ARG_CONFIG),
+                }, {
+                    0, /* No more descriptors in this characteristic. */
+                },
+            },
+        }, {
+            .uuid = BLE_UUID16_DECLARE(HISTORY_VAL),
+            .access_cb = gatt_svr_hist_access,
+            .val_handle = &gatt_svr_hist_val_handle,
+            .flags = BLE_GATT_CHR_F_NOTIFY,
+        }, {
+            .uuid = BLE_UUID16_DECLARE(HISTORY_CTRL),
+            .access_cb = gatt_svr_hist_access,
+            .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
         }, {
             0, /* No more characteristics in this service. */
         } },
@@ -134,6 +279,8 @@ gatt_svr_chr_access_sec_test(uint16_t conn_handle, uint16_t attr_handle,
     int rand_num;
     int rc;
 
+    connparam_activity(conn_handle);
+
     uuid = ctxt->chr->uuid;
 
     /* Determine which characteristic is being accessed by examining its
@@ -184,6 +331,8 @@ gatt_svr_sns_access(uint16_t conn_handle, uint16_t attr_handle,
     uint16_t uuid16;
     int rc;
 
+    connparam_activity(conn_handle);
+
     uuid16 = ble_uuid_u16(ctxt->chr->uuid);
 
     switch (uuid16) {
@@ -212,6 +361,498 @@ gatt_svr_sns_access(uint16_t conn_handle, uint16_t attr_handle,
     }
 }
 
+static void
+gatt_svr_put_le16(uint8_t *buf, uint16_t val)
+{
+    buf[0] = val;
+    buf[1] = val >> 8;
+}
+
+static void
+gatt_svr_put_le32(uint8_t *buf, uint32_t val)
+{
+    buf[0] = val;
+    buf[1] = val >> 8;
+    buf[2] = val >> 16;
+    buf[3] = val >> 24;
+}
+
+static void
+gatt_svr_hist_stop(void)
+{
+    os_callout_stop(&gatt_svr_hist_timer);
+    gatt_svr_hist_conn = BLE_HS_CONN_HANDLE_NONE;
+}
+
+/**
+ * Sends one notification's worth of history records, or the empty
+ * notification that ends the transfer.
+ */
+static int
+gatt_svr_hist_tx(void)
+{
+    struct history_rec rec;
+    struct os_mbuf *om;
+    uint8_t buf[GATT_SVR_HIST_HDR_LEN];
+    uint32_t first;
+    uint16_t payload;
+    int cnt;
+    int rc;
+    int i;
+
+    payload = connparam_att_payload(gatt_svr_hist_conn);
+    if (payload < GATT_SVR_HIST_HDR_LEN) {
+        return BLE_HS_ENOTCONN;
+    }
+
+    /* A stalled transfer can fall so far behind that the ring has
+     * overwritten everything up to the end; there is nothing left to send.
+     */
+    first = history_first();
+    if (gatt_svr_hist_seq < first) {
+        gatt_svr_hist_seq = first;
+    }
+    if (gatt_svr_hist_seq >= gatt_svr_hist_end) {
+        cnt = 0;
+    } else {
+        cnt = (payload - GATT_SVR_HIST_HDR_LEN) / GATT_SVR_HIST_REC_LEN;
+        if ((uint32_t)cnt > gatt_svr_hist_end - gatt_svr_hist_seq) {
+            cnt = gatt_svr_hist_end - gatt_svr_hist_seq;
+        }
+    }
+
+    om = ble_hs_mbuf_att_pkt();
+    if (om == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+
+    gatt_svr_put_le32(buf, history_now());
+    gatt_svr_put_le32(buf + 4, gatt_svr_hist_seq);
+    buf[8] = cnt;
+    rc = os_mbuf_append(om, buf, GATT_SVR_HIST_HDR_LEN);
+
+    for (i = 0; i < cnt && rc == 0; i++) {
+        if (history_read(gatt_svr_hist_seq + i, &rec) != 0) {
+            /* Gone from the ring; send what we have and say so. */
+            cnt = i;
+            buf[0] = cnt;
+            rc = os_mbuf_copyinto(om, 8, buf, 1);
+            break;
+        }
+        gatt_svr_put_le32(buf, rec.hr_time);
+        gatt_svr_put_le16(buf + 4, rec.hr_co2);
+        buf[6] = rec.hr_status;
+        rc = os_mbuf_append(om, buf, GATT_SVR_HIST_REC_LEN);
+    }
+    if (rc != 0) {
+        os_mbuf_free_chain(om);
+        return BLE_HS_ENOMEM;
+    }
+
+    /* The host frees the mbuf whether or not this succeeds. */
+    rc = ble_gattc_notify_custom(gatt_svr_hist_conn,
+                                 gatt_svr_hist_val_handle, om);
+    if (rc != 0) {
+        return rc;
+    }
+
+    gatt_svr_hist_seq += cnt;
+    return cnt == 0 ? BLE_HS_EDONE : 0;
+}
+
+static void
+gatt_svr_hist_timer_ev(struct os_event *ev)
+{
+    int rc;
+    int i;
+
+    /* Keep the link at bulk parameters for the rest of the transfer. */
+    connparam_activity(gatt_svr_hist_conn);
+
+    for (i = 0; i < GATT_SVR_HIST_BURST; i++) {
+        rc = gatt_svr_hist_tx();
+        if (rc == BLE_HS_ENOMEM) {
+            /* Out of buffers; let the controller drain what is queued. */
+            os_callout_reset(&gatt_svr_hist_timer, GATT_SVR_HIST_RETRY_TICKS);
+            return;
+        }
+        if (rc != 0) {
+            if (rc != BLE_HS_EDONE) {
+                BLEPRPH_LOG(INFO, "history transfer failed; rc=%d\n", rc);
+            }
+            gatt_svr_hist_stop();
+            return;
+        }
+    }
+    os_callout_reset(&gatt_svr_hist_timer, 0);
+}
+
+static struct gatt_svr_sub *
+gatt_svr_sub_find(uint16_t conn_handle)
+{
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        if (gatt_svr_subs[i].conn_handle == conn_handle) {
+            return &gatt_svr_subs[i];
+        }
+    }
+    return NULL;
+}
+
+static int
+gatt_svr_hist_access(uint16_t conn_handle, uint16_t attr_handle,
+                     struct ble_gatt_access_ctxt *ctxt,
+                     void *arg)
+{
+    struct gatt_svr_sub *sub;
+    uint8_t buf[12];
+    uint16_t len;
+    int rc;
+
+    connparam_activity(conn_handle);
+
+    if (ble_uuid_u16(ctxt->chr->uuid) != HISTORY_CTRL) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    switch (ctxt->op) {
+    case BLE_GATT_ACCESS_OP_READ_CHR:
+        gatt_svr_put_le32(buf, history_first());
+        gatt_svr_put_le32(buf + 4, history_next());
+        gatt_svr_put_le32(buf + 8, history_now());
+        rc = os_mbuf_append(ctxt->om, buf, 12);
+        return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+
+    case BLE_GATT_ACCESS_OP_WRITE_CHR:
+        rc = gatt_svr_chr_write(ctxt->om, 1, 5, buf, &len);
+        if (rc != 0) {
+            return rc;
+        }
+
+        switch (buf[0]) {
+        case GATT_SVR_HIST_OP_SEND:
+            if (len != 5) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            sub = gatt_svr_sub_find(conn_handle);
+            if (sub == NULL || !(sub->sns_mask & GATT_SVR_SUB_F_HIST)) {
+                return GATT_SVR_ATT_ERR_CCCD_IMPROPER;
+            }
+            if (gatt_svr_hist_conn != BLE_HS_CONN_HANDLE_NONE &&
+                gatt_svr_hist_conn != conn_handle) {
+
+                return GATT_SVR_ATT_ERR_IN_PROGRESS;
+            }
+            gatt_svr_hist_conn = conn_handle;
+            gatt_svr_hist_seq = buf[1] | (buf[2] << 8) | (buf[3] << 16) |
+                                ((uint32_t)buf[4] << 24);
+            gatt_svr_hist_end = history_next();
+            if (gatt_svr_hist_seq > gatt_svr_hist_end) {
+                gatt_svr_hist_seq = gatt_svr_hist_end;
+            }
+            BLEPRPH_LOG(INFO, "history transfer; conn_handle=%d seq=%lu "
+                              "end=%lu\n", conn_handle,
+                        (unsigned long)gatt_svr_hist_seq,
+                        (unsigned long)gatt_svr_hist_end);
+            os_callout_reset(&gatt_svr_hist_timer, 0);
+            return 0;
+
+        case GATT_SVR_HIST_OP_ABORT:
+            if (gatt_svr_hist_conn == conn_handle) {
+                gatt_svr_hist_stop();
+            }
+            return 0;
+
+        default:
+            return GATT_SVR_ATT_ERR_WRITE_REJECTED;
+        }
+
+    default:
+        assert(0);
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+}
+
+/**
+ * Encodes a trigger the way the ES Trigger Setting descriptor carries it:
+ * the condition followed by a uint24 time in seconds or the uint16 value to
+ * compare with.
+ */
+static int
+gatt_svr_trig_encode(const struct gatt_svr_trig *trig, uint8_t *buf)
+{
+    buf[0] = trig->cond;
+    switch (trig->cond) {
+    case GATT_SVR_TRIG_FIXED_ITVL:
+    case GATT_SVR_TRIG_MIN_ITVL:
+        buf[1] = trig->operand;
+        buf[2] = trig->operand >> 8;
+        buf[3] = trig->operand >> 16;
+        return 4;
+
+    case GATT_SVR_TRIG_CHANGED:
+        if (trig->operand == 0) {
+            return 1;
+        }
+        /* Fall through; a deadband is carried like a threshold. */
+    case GATT_SVR_TRIG_LT:
+    case GATT_SVR_TRIG_LE:
+    case GATT_SVR_TRIG_GT:
+    case GATT_SVR_TRIG_GE:
+    case GATT_SVR_TRIG_EQ:
+    case GATT_SVR_TRIG_NE:
+        buf[1] = trig->operand;
+        buf[2] = trig->operand >> 8;
+        return 3;
+
+    default:
+        return 1;
+    }
+}
+
+static int
+gatt_svr_trig_decode(struct gatt_svr_trig *trig, const uint8_t *buf,
+                     uint16_t len)
+{
+    if (len < 1) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    trig->cond = buf[0];
+    trig->operand = 0;
+    switch (buf[0]) {
+    case GATT_SVR_TRIG_INACTIVE:
+        break;
+
+    case GATT_SVR_TRIG_FIXED_ITVL:
+    case GATT_SVR_TRIG_MIN_ITVL:
+        if (len != 4) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        trig->operand = buf[1] | (buf[2] << 8) | ((uint32_t)buf[3] << 16);
+        if (trig->cond == GATT_SVR_TRIG_FIXED_ITVL && trig->operand == 0) {
+            return GATT_SVR_ATT_ERR_WRITE_REJECTED;
+        }
+        return 0;
+
+    case GATT_SVR_TRIG_CHANGED:
+        /* The ppm deadband is an extension; plain ESS writes one byte. */
+        if (len == 1) {
+            return 0;
+        }
+        /* Fall through. */
+    case GATT_SVR_TRIG_LT:
+    case GATT_SVR_TRIG_LE:
+    case GATT_SVR_TRIG_GT:
+    case GATT_SVR_TRIG_GE:
+    case GATT_SVR_TRIG_EQ:
+    case GATT_SVR_TRIG_NE:
+        if (len != 3) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        trig->operand = buf[1] | (buf[2] << 8);
+        return 0;
+
+    default:
+        return GATT_SVR_ATT_ERR_COND_UNSUPPORTED;
+    }
+
+    return len == 1 ? 0 : BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+}
+
+static int
+gatt_svr_sns_dsc_access(uint16_t conn_handle, uint16_t attr_handle,
+                        struct ble_gatt_access_ctxt *ctxt,
+                        void *arg)
+{
+    struct gatt_svr_sns_trig *st;
+    struct gatt_svr_trig trig;
+    uint8_t buf[4];
+    uint16_t len;
+    int idx;
+    int rc;
+
+    connparam_activity(conn_handle);
+
+    st = &gatt_svr_sns_trigs[(uintptr_t)arg >> 8];
+    idx = (uintptr_t)arg & 0xff;
+
+    if (idx == GATT_SVR_DSC_ARG_CONFIG) {
+        switch (ctxt->op) {
+        case BLE_GATT_ACCESS_OP_READ_DSC:
+            rc = os_mbuf_append(ctxt->om, &st->config, sizeof st->config);
+            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+
+        case BLE_GATT_ACCESS_OP_WRITE_DSC:
+            rc = gatt_svr_chr_write(ctxt->om, 1, 1, buf, NULL);
+            if (rc != 0) {
+                return rc;
+            }
+            if (buf[0] != GATT_SVR_ES_CONFIG_OR &&
+                buf[0] != GATT_SVR_ES_CONFIG_AND) {
+                return GATT_SVR_ATT_ERR_WRITE_REJECTED;
+            }
+            st->config = buf[0];
+            st->notified = 0;
+            return 0;
+
+        default:
+            assert(0);
+            return BLE_ATT_ERR_UNLIKELY;
+        }
+    }
+
+    assert(idx < GATT_SVR_SNS_TRIG_CNT);
+    switch (ctxt->op) {
+    case BLE_GATT_ACCESS_OP_READ_DSC:
+        len = gatt_svr_trig_encode(&st->trig[idx], buf);
+        rc = os_mbuf_append(ctxt->om, buf, len);
+        return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+
+    case BLE_GATT_ACCESS_OP_WRITE_DSC:
+        rc = gatt_svr_chr_write(ctxt->om, 1, sizeof buf, buf, &len);
+        if (rc != 0) {
+            return rc;
+        }
+        rc = gatt_svr_trig_decode(&trig, buf, len);
+        if (rc != 0) {
+            return rc;
+        }
+        BLEPRPH_LOG(INFO, "trigger %d set; cond=%d operand=%lu\n", idx,
+                    trig.cond, (unsigned long)trig.operand);
+        st->trig[idx] = trig;
+        st->cmp_valid &= ~(1 << idx);
+        st->notified = 0;
+        return 0;
+
+    default:
+        assert(0);
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+}
+
+static int
+gatt_svr_trig_cmp(uint8_t cond, uint16_t val, uint32_t operand)
+{
+    switch (cond) {
+    case GATT_SVR_TRIG_LT:
+        return val < operand;
+    case GATT_SVR_TRIG_LE:
+        return val <= operand;
+    case GATT_SVR_TRIG_GT:
+        return val > operand;
+    case GATT_SVR_TRIG_GE:
+        return val >= operand;
+    case GATT_SVR_TRIG_EQ:
+        return val == operand;
+    default:
+        return val != operand;
+    }
+}
+
+/**
+ * Evaluates the notification triggers of a sensor characteristic against a
+ * new reading.
+ *
+ * Triggers are combined according to the ES Configuration descriptor.
+ * Threshold conditions fire when the comparison result changes, i.e. when
+ * the value crosses the threshold, rather than on every reading that
+ * satisfies it.  A "no less than" interval is a rate limit applied on top of
+ * the other triggers; on its own it notifies changes.  The first reading
+ * after a trigger write or a new subscription is always notified.
+ *
+ * @return                      1 if the value should be notified;
+ *                              0 otherwise.
+ */
+int
+gatt_svr_sns_triggered(enum gatt_svr_sns sns, uint16_t val)
+{
+    struct gatt_svr_sns_trig *st;
+    struct gatt_svr_trig *trig;
+    uint32_t elapsed;
+    os_time_t now;
+    uint8_t bit;
+    int active;
+    int fired;
+    int limit;
+    int hit;
+    int cmp;
+    int i;
+
+    assert(sns < GATT_SVR_SNS_CNT);
+    st = &gatt_svr_sns_trigs[sns];
+
+    now = os_time_get();
+    elapsed = (uint32_t)(now - st->last_time) / OS_TICKS_PER_SEC;
+
+    active = 0;
+    fired = 0;
+    limit = 0;
+    for (i = 0; i < GATT_SVR_SNS_TRIG_CNT; i++) {
+        trig = &st->trig[i];
+        bit = 1 << i;
+
+        switch (trig->cond) {
+        case GATT_SVR_TRIG_INACTIVE:
+            continue;
+
+        case GATT_SVR_TRIG_MIN_ITVL:
+            if (st->notified && elapsed < trig->operand) {
+                limit = 1;
+            }
+            continue;
+
+        case GATT_SVR_TRIG_FIXED_ITVL:
+            hit = elapsed >= trig->operand;
+            break;
+
+        case GATT_SVR_TRIG_CHANGED:
+            hit = abs((int)val - (int)st->last_val) > (int)trig->operand;
+            break;
+
+        default:
+            cmp = gatt_svr_trig_cmp(trig->cond, val, trig->operand);
+            if (st->cmp_valid & bit) {
+                hit = cmp != !!(st->cmp_state & bit);
+            } else {
+                hit = cmp;
+            }
+            st->cmp_valid |= bit;
+            if (cmp) {
+                st->cmp_state |= bit;
+            } else {
+                st->cmp_state &= ~bit;
+            }
+            break;
+        }
+
+        if (active == 0) {
+            fired = hit;
+        } else if (st->config == GATT_SVR_ES_CONFIG_AND) {
+            fired = fired && hit;
+        } else {
+            fired = fired || hit;
+        }
+        active++;
+    }
+
+    if (active == 0) {
+        fired = val != st->last_val;
+    }
+    if (!st->notified) {
+        fired = 1;
+    }
+    if (!fired || limit) {
+        return 0;
+    }
+
+    st->notified = 1;
+    st->last_val = val;
+    st->last_time = now;
+    return 1;
+}
+
 void
 gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
 {
@@ -230,6 +871,11 @@ gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
                     ble_uuid_to_str(ctxt->chr.chr_def->uuid, buf),
                     ctxt->chr.def_handle,
                     ctxt->chr.val_handle);
+        if (ble_uuid_cmp(ctxt->chr.chr_def->uuid,
+                         &gatt_svr_chr_nmgr_uuid.u) == 0) {
+
+            gatt_svr_nmgr_val_handle = ctxt->chr.val_handle;
+        }
         break;
 
     case BLE_GATT_REGISTER_OP_DSC:
@@ -244,10 +890,155 @@ gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
     }
 }
 
+/**
+ * Returns the value handle of a sensor characteristic, for notifying.
+ * Only valid once the host has registered the GATT services.
+ */
+uint16_t
+gatt_svr_sns_val_handle(enum gatt_svr_sns sns)
+{
+    assert(sns < GATT_SVR_SNS_CNT);
+    return gatt_svr_sns_val_handles[sns];
+}
+
+/**
+ * Notes a notification sent on a connection.  newtmgr answers each request
+ * with one, so a run of them on its characteristic (an image upload, say)
+ * counts as bulk traffic and keeps an upload session going.
+ */
+void
+gatt_svr_notify_tx(uint16_t conn_handle, uint16_t attr_handle)
+{
+    if (attr_handle != 0 && attr_handle == gatt_svr_nmgr_val_handle) {
+        connparam_activity(conn_handle);
+        upgrade_activity();
+    }
+}
+
+/**
+ * Tracks a subscription change reported by the host.
+ *
+ * @return                      The sensor whose subscriber count changed, or
+ *                                  -1 if none did.
+ */
+int
+gatt_svr_subscribe(uint16_t conn_handle, uint16_t attr_handle, int on)
+{
+    struct gatt_svr_sub *sub;
+    uint8_t bit;
+    int sns;
+
+    if (attr_handle == gatt_svr_hist_val_handle) {
+        if (!on && gatt_svr_hist_conn == conn_handle) {
+            gatt_svr_hist_stop();
+        }
+        sns = -1;
+        bit = GATT_SVR_SUB_F_HIST;
+    } else {
+        for (sns = 0; sns < GATT_SVR_SNS_CNT; sns++) {
+            if (gatt_svr_sns_val_handles[sns] == attr_handle) {
+                break;
+            }
+        }
+        if (sns == GATT_SVR_SNS_CNT) {
+            return -1;
+        }
+        bit = 1 << sns;
+    }
+
+    sub = gatt_svr_sub_find(conn_handle);
+    if (sub == NULL) {
+        if (!on) {
+            return -1;
+        }
+        sub = gatt_svr_sub_find(BLE_HS_CONN_HANDLE_NONE);
+        if (sub == NULL) {
+            return -1;
+        }
+        sub->conn_handle = conn_handle;
+        sub->sns_mask = 0;
+    }
+
+    if (on == !!(sub->sns_mask & bit)) {
+        return -1;
+    }
+    if (on) {
+        sub->sns_mask |= bit;
+    } else {
+        sub->sns_mask &= ~bit;
+    }
+    if (sub->sns_mask == 0) {
+        sub->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    if (sns < 0) {
+        return -1;
+    }
+
+    if (on) {
+        gatt_svr_sns_sub_cnt[sns]++;
+
+        /* Give the new subscriber the next reading regardless of triggers. */
+        gatt_svr_sns_trigs[sns].notified = 0;
+    } else {
+        gatt_svr_sns_sub_cnt[sns]--;
+    }
+    return sns;
+}
+
+/**
+ * Drops all subscriptions of a connection that went away.
+ */
+void
+gatt_svr_conn_broken(uint16_t conn_handle)
+{
+    struct gatt_svr_sub *sub;
+    int sns;
+
+    if (gatt_svr_hist_conn == conn_handle) {
+        gatt_svr_hist_stop();
+    }
+
+    sub = gatt_svr_sub_find(conn_handle);
+    if (sub == NULL) {
+        return;
+    }
+    for (sns = 0; sns < GATT_SVR_SNS_CNT; sns++) {
+        if (sub->sns_mask & (1 << sns)) {
+            gatt_svr_sns_sub_cnt[sns]--;
+        }
+    }
+    sub->sns_mask = 0;
+    sub->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+}
+
+/**
+ * Returns the number of connections subscribed to a sensor characteristic.
+ */
+int
+gatt_svr_sns_subscribers(enum gatt_svr_sns sns)
+{
+    assert(sns < GATT_SVR_SNS_CNT);
+    return gatt_svr_sns_sub_cnt[sns];
+}
+
 int
 gatt_svr_init(void)
 {
     int rc;
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        gatt_svr_subs[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
+
+    gatt_svr_hist_conn = BLE_HS_CONN_HANDLE_NONE;
+    os_callout_init(&gatt_svr_hist_timer, os_eventq_dflt_get(),
+                    gatt_svr_hist_timer_ev, NULL);
+
+    /* By default, notify only readings that differ from the last one. */
+    for (i = 0; i < GATT_SVR_SNS_CNT; i++) {
+        gatt_svr_sns_trigs[i].trig[0].cond = GATT_SVR_TRIG_CHANGED;
+    }
 
     rc = ble_gatts_count_cfg(gatt_svr_svcs);
     if (rc != 0) {
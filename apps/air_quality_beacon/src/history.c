@@ -0,0 +1,98 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <assert.h>
+#include "os/os.h"
+#include "syscfg/syscfg.h"
+#include "history.h"
+
+#define HISTORY_CNT     MYNEWT_VAL(AIRQ_HISTORY_CNT)
+
+/* RAM ring of the last HISTORY_CNT samples; record seq lives in slot
+ * seq % HISTORY_CNT.
+ */
+static struct history_rec history_buf[HISTORY_CNT];
+static uint32_t history_next_seq;
+
+/**
+ * Returns the time base used for record timestamps: seconds since boot.
+ */
+uint32_t
+history_now(void)
+{
+    return os_time_get() / OS_TICKS_PER_SEC;
+}
+
+/**
+ * Stores a sample, overwriting the oldest one once the ring is full.
+ *
+ * @return                      The sequence number of the new record.
+ */
+uint32_t
+history_add(uint16_t co2, uint8_t status)
+{
+    struct history_rec *rec;
+    uint32_t seq;
+
+    seq = history_next_seq++;
+    rec = &history_buf[seq % HISTORY_CNT];
+    rec->hr_time = history_now();
+    rec->hr_co2 = co2;
+    rec->hr_status = status;
+
+    return seq;
+}
+
+/**
+ * Returns the sequence number of the oldest record still held.
+ */
+uint32_t
+history_first(void)
+{
+    if (history_next_seq <= HISTORY_CNT) {
+        return 0;
+    }
+    return history_next_seq - HISTORY_CNT;
+}
+
+/**
+ * Returns the sequence number the next record will get.
+ */
+uint32_t
+history_next(void)
+{
+    return history_next_seq;
+}
+
+/**
+ * Reads a record by sequence number.
+ *
+ * @return                      0 on success;
+ *                              -1 if the record was overwritten or does not
+ *                                  exist yet.
+ */
+int
+history_read(uint32_t seq, struct history_rec *out)
+{
+    if (seq < history_first() || seq >= history_next_seq) {
+        return -1;
+    }
+    *out = history_buf[seq % HISTORY_CNT];
+    return 0;
+}
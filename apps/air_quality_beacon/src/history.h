@@ -6,7 +6,7 @@
  * to you under the Apache License, Version 2.0 (the
  * "License"); you may not use this file except in compliance
  * with the License.  You may obtain a copy of the License at
- *
+ * 
  *  http://www.apache.org/licenses/LICENSE-2.0
  *
  * Unless required by applicable law or agreed to in writing,
@@ -15,29 +15,37 @@
  * KIND, either express or implied.  See the License for the
  * specific language governing permissions and limitations
  * under the License.
- */
+*/
+
+#ifndef H_HISTORY_
+#define H_HISTORY_
 
-#include "bleprph.h"
+#include <inttypes.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /**
- * Utility function to log an array of bytes.
+ * One stored CO2 sample.  Records are numbered by a sequence number that
+ * starts at 0 at boot and grows by one per record; the sequence number is
+ * implied by the record's position and not stored.
  */
-void
-print_bytes(const uint8_t *bytes, int len)
-{
-    int i;
+struct history_rec {
+    /** Seconds since boot when the sample was taken. */
+    uint32_t hr_time;
+    uint16_t hr_co2;
+    /** Meter status; the K30 defines only the low eight bits. */
+    uint8_t hr_status;
+};
 
-    for (i = 0; i < len; i++) {
-        BLEPRPH_LOG(INFO, "%s0x%02x", i != 0 ? ":" : "", bytes[i]);
-    }
-}
-
-void
-print_addr(const void *addr)
-{
-    const uint8_t *u8p;
+uint32_t history_add(uint16_t co2, uint8_t status);
+uint32_t history_first(void);
+uint32_t history_next(void);
+int history_read(uint32_t seq, struct history_rec *out);
+uint32_t history_now(void);
 
-    u8p = addr;
-    BLEPRPH_LOG(INFO, "%02x:%02x:%02x:%02x:%02x:%02x",
-                u8p[5], u8p[4], u8p[3], u8p[2], u8p[1], u8p[0]);
+#ifdef __cplusplus
 }
+#endif
+
+#endif
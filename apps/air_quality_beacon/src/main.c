@@ -26,7 +26,6 @@
 #include "os/os.h"
 #include "bsp/bsp.h"
 #include "hal/hal_gpio.h"
-#include "console/console.h"
 #include "senseair/senseair.h"
 #include "shell/shell.h"
 
@@ -42,71 +41,101 @@
 
 /* Application-specified header. */
 #include "bleprph.h"
+#include "sampler.h"
+#include "history.h"
+#include "slog.h"
+#include "adv_payload.h"
+#include "connparam.h"
+#include "upgrade.h"
+#include "trace.h"
 
 /** Log data. */
 struct log bleprph_log;
 
-/* CO2 Task settings */
-#define CO2_TASK_PRIO           5
-#define CO2_STACK_SIZE          (OS_STACK_ALIGN(336))
-struct os_eventq co2_evq;
-struct os_task co2_task;
-bssnz_t os_stack_t co2_stack[CO2_STACK_SIZE];
+/* CO2 sampling settings; the interval adapts between
+ * AIRQ_SAMPLE_FAST_MS and AIRQ_SAMPLE_SLOW_MS, or AIRQ_SAMPLE_IDLE_MS while
+ * nobody is subscribed.
+ */
+#define CO2_SAMPLE_ITVL \
+    (MYNEWT_VAL(AIRQ_SAMPLE_FAST_MS) * OS_TICKS_PER_SEC / 1000)
+
+static void co2_sample_job(struct sampler_job *job);
+
+static struct senseair *co2_sensor;
+
+static struct sampler_job co2_job = {
+    .sj_fn = co2_sample_job,
+    .sj_period = CO2_SAMPLE_ITVL,
+    .sj_phase = 0,
+};
+static struct sampler_adapt co2_adapt;
+
+/* Longest interval while no connection is subscribed to the CO2
+ * characteristic.
+ */
+#define CO2_SAMPLE_IDLE_ITVL \
+    (MYNEWT_VAL(AIRQ_SAMPLE_IDLE_MS) * OS_TICKS_PER_SEC / 1000)
 
 static int bleprph_gap_event(struct ble_gap_event *event, void *arg);
 
-/* A buffer for host advertising data */
-uint8_t g_host_adv_data[BLE_HCI_MAX_ADV_DATA_LEN];
-uint8_t g_host_adv_len;
+/* Advertising data of the connectable instance and of the beacon. */
+static struct adv_payload bleprph_adv_data;
+static struct adv_payload bcast_adv_data;
 
-/**
- * Logs information about a connection to the console.
+/* Multi-adv instance carrying the beacon frames. */
+#define BCAST_INSTANCE          1
+
+/* Offset of the TX power byte in the Eddystone service data. */
+#define BCAST_EDDYSTONE_PWR     3
+
+/* The beacon frames can be followed by manufacturer specific data with the
+ * latest reading, so passive scanners get it without connecting:
+ *     <company id> <frame type> <co2> <seq> <status>
+ * company id, co2 (ppm) and seq are little-endian uint16s.  seq is bumped
+ * whenever co2 or status change, so a scanner can drop repeats.
  */
-static void
-bleprph_print_conn_desc(struct ble_gap_conn_desc *desc)
-{
-    BLEPRPH_LOG(INFO, "handle=%d our_ota_addr_type=%d our_ota_addr=",
-                desc->conn_handle, desc->our_ota_addr_type);
-    print_addr(desc->our_ota_addr);
-    BLEPRPH_LOG(INFO, " our_id_addr_type=%d our_id_addr=",
-                desc->our_id_addr_type);
-    print_addr(desc->our_id_addr);
-    BLEPRPH_LOG(INFO, " peer_ota_addr_type=%d peer_ota_addr=",
-                desc->peer_ota_addr_type);
-    print_addr(desc->peer_ota_addr);
-    BLEPRPH_LOG(INFO, " peer_id_addr_type=%d peer_id_addr=",
-                desc->peer_id_addr_type);
-    print_addr(desc->peer_id_addr);
-    BLEPRPH_LOG(INFO, " conn_itvl=%d conn_latency=%d supervision_timeout=%d "
-                "encrypted=%d authenticated=%d bonded=%d\n",
-                desc->conn_itvl, desc->conn_latency,
-                desc->supervision_timeout,
-                desc->sec_state.encrypted,
-                desc->sec_state.authenticated,
-                desc->sec_state.bonded);
-}
+#define BCAST_MFG_LEN           8
+#define BCAST_MFG_CO2           3
+#define BCAST_MFG_SEQ           5
+#define BCAST_MFG_STATUS        7
+#define BCAST_FRAME_SENSOR      0x01
+#define BCAST_STATUS_F_READ_ERR 0x80
+
+static int bcast_mfg_off = -1;
+static uint16_t bcast_seq;
+static int bcast_running;
+
+/* Advertising schedules.  Both instances advertise at a fast interval for a
+ * while after boot, and the connectable one also after a disconnect, so
+ * centrals find the device quickly; then they drop to a slow interval.
+ */
+#define ADV_ITVL_MS(ms)         ((ms) * 1000 / BLE_HCI_ADV_ITVL)
+
+enum bleprph_adv_mode {
+    BLEPRPH_ADV_FAST,
+    BLEPRPH_ADV_SLOW,
+};
+
+static struct hci_multi_adv_params bcast_params;
+static struct os_callout bcast_sched_timer;
 
 /**
- * Enables advertising with the following parameters:
- *     o General discoverable mode.
- *     o Undirected connectable mode.
+ * Encodes the advertising data of the connectable instance:
+ *     o Flags (indicates advertisement type and other general info).
+ *     o Advertising tx power.
+ *     o Device name.
+ *     o 16-bit service UUIDs (alert notifications).
+ *
+ * None of it changes while the host is in sync, so this is done once per
+ * sync rather than every time advertising restarts.
  */
 static void
-bleprph_advertise(void)
+bleprph_adv_data_build(void)
 {
-    struct ble_gap_adv_params adv_params;
     struct ble_hs_adv_fields fields;
     const char *name;
     int rc;
 
-    /**
-     *  Set the advertisement data included in our advertisements:
-     *     o Flags (indicates advertisement type and other general info).
-     *     o Advertising tx power.
-     *     o Device name.
-     *     o 16-bit service UUIDs (alert notifications).
-     */
-
     memset(&fields, 0, sizeof fields);
 
     /* Indicate that the flags field should be included; specify a value of 0
@@ -131,53 +160,155 @@ bleprph_advertise(void)
     fields.num_uuids16 = 1;
     fields.uuids16_is_complete = 1;
 
-    rc = ble_gap_adv_set_fields(&fields);
+    adv_payload_init(&bleprph_adv_data);
+    rc = adv_payload_set_fields(&bleprph_adv_data, &fields);
+    if (rc != 0) {
+        BLEPRPH_LOG(ERROR, "error encoding advertisement data; rc=%d\n", rc);
+    }
+}
+
+static int
+bleprph_adv_tx(const uint8_t *data, uint8_t len, void *arg)
+{
+    return ble_gap_adv_set_data(data, len);
+}
+
+/**
+ * Enables advertising with the following parameters:
+ *     o General discoverable mode.
+ *     o Undirected connectable mode.
+ *     o Fast: AIRQ_ADV_FAST_ITVL_MS for AIRQ_ADV_FAST_WINDOW_MS, after which
+ *       the host reports BLE_GAP_EVENT_ADV_COMPLETE and advertising
+ *       restarts slow.
+ *     o Slow: AIRQ_ADV_SLOW_ITVL_MS, until stopped.
+ */
+static void
+bleprph_advertise(enum bleprph_adv_mode mode)
+{
+    struct ble_gap_adv_params adv_params;
+    int32_t duration;
+    int rc;
+
+    /* Only goes to the controller if the data changed. */
+    rc = adv_payload_commit(&bleprph_adv_data, bleprph_adv_tx, NULL);
     if (rc != 0) {
         BLEPRPH_LOG(ERROR, "error setting advertisement data; rc=%d\n", rc);
         return;
     }
 
+    /* Switching schedules; stop whatever is running first. */
+    if (ble_gap_adv_active()) {
+        ble_gap_adv_stop();
+    }
+
     /* Begin advertising. */
     memset(&adv_params, 0, sizeof adv_params);
     adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
     adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
-    ble_gap_adv_start(BLE_ADDR_TYPE_PUBLIC, 0, NULL, BLE_HS_FOREVER,
-                      &adv_params, bleprph_gap_event, NULL);
+    if (mode == BLEPRPH_ADV_FAST && MYNEWT_VAL(AIRQ_ADV_FAST_WINDOW_MS) > 0) {
+        adv_params.itvl_min = ADV_ITVL_MS(MYNEWT_VAL(AIRQ_ADV_FAST_ITVL_MS));
+        duration = MYNEWT_VAL(AIRQ_ADV_FAST_WINDOW_MS);
+    } else {
+        adv_params.itvl_min = ADV_ITVL_MS(MYNEWT_VAL(AIRQ_ADV_SLOW_ITVL_MS));
+        duration = BLE_HS_FOREVER;
+    }
+    adv_params.itvl_max = adv_params.itvl_min;
+
+    rc = ble_gap_adv_start(BLE_ADDR_TYPE_PUBLIC, 0, NULL, duration,
+                           &adv_params, bleprph_gap_event, NULL);
+    if (rc != 0) {
+        BLEPRPH_LOG(ERROR, "error enabling advertisement; rc=%d\n", rc);
+    }
 }
 
-uint8_t
-bletest_set_adv_data(uint8_t *dptr, uint8_t *addr)
+/**
+ * Encodes the beacon's advertising data: an Eddystone URL frame, followed
+ * by the sensor frame if AIRQ_BCAST_SENSOR is set.
+ */
+static void
+bcast_adv_data_build(int8_t tx_pwr)
 {
-    uint8_t len;
-
-    dptr[0] = 0x03;   /* Length of Service List */
-    dptr[1] = 0x03;   /* Param: Service List */
-    dptr[2] = 0xAA;   /* Eddystone ID */
-    dptr[3] = 0xFE;   /* Eddystone ID */
-    dptr[4] = 0x10;   /* Length of Service Data */
-    dptr[5] = 0x16;   /* Service Data */
-    dptr[6] = 0xAA;   /* Eddystone ID */
-    dptr[7] = 0xFE;   /* Eddystone ID */
-    dptr[8] = 0x10;   /* Frame type: URL */
-    dptr[9] = 0x00;   /* Power */
-    dptr[10] = 0x03;  /* https:// */
-    dptr[11] = 'r';
-    dptr[12] = 'u';
-    dptr[13] = 'n';
-    dptr[14] = 't';
-    dptr[15] = 'i';
-    dptr[16] = 'm';
-    dptr[17] = 'e';
-    dptr[18] = '.';
-    dptr[19] = 'i';
-    dptr[20] = 'o';
-
-    len = 21;
-    addr = NULL;
-
-    g_host_adv_len = len;
-
-    return len;
+    static const uint8_t eddystone_uuid[] = { 0xAA, 0xFE };
+    static const uint8_t eddystone_url[] = {
+        0xAA, 0xFE,     /* Eddystone ID */
+        0x10,           /* Frame type: URL */
+        0x00,           /* Power */
+        0x03,           /* https:// */
+        'r', 'u', 'n', 't', 'i', 'm', 'e', '.', 'i', 'o',
+    };
+#if MYNEWT_VAL(AIRQ_BCAST_SENSOR)
+    uint8_t mfg[BCAST_MFG_LEN];
+#endif
+    int off;
+
+    adv_payload_init(&bcast_adv_data);
+    adv_payload_add(&bcast_adv_data, BLE_HS_ADV_TYPE_COMP_UUIDS16,
+                    eddystone_uuid, sizeof eddystone_uuid);
+    off = adv_payload_add(&bcast_adv_data, BLE_HS_ADV_TYPE_SVC_DATA_UUID16,
+                          eddystone_url, sizeof eddystone_url);
+    assert(off >= 0);
+    adv_payload_patch(&bcast_adv_data, off + BCAST_EDDYSTONE_PWR, &tx_pwr, 1);
+
+#if MYNEWT_VAL(AIRQ_BCAST_SENSOR)
+    mfg[0] = MYNEWT_VAL(AIRQ_BCAST_COMPANY_ID) & 0xff;
+    mfg[1] = MYNEWT_VAL(AIRQ_BCAST_COMPANY_ID) >> 8;
+    mfg[2] = BCAST_FRAME_SENSOR;
+    mfg[BCAST_MFG_CO2] = gatt_co2_val & 0xff;
+    mfg[BCAST_MFG_CO2 + 1] = gatt_co2_val >> 8;
+    mfg[BCAST_MFG_SEQ] = bcast_seq & 0xff;
+    mfg[BCAST_MFG_SEQ + 1] = bcast_seq >> 8;
+    mfg[BCAST_MFG_STATUS] = BCAST_STATUS_F_READ_ERR;
+    bcast_mfg_off = adv_payload_add(&bcast_adv_data, BLE_HS_ADV_TYPE_MFG_DATA,
+                                    mfg, sizeof mfg);
+    assert(bcast_mfg_off >= 0);
+#endif
+}
+
+static int
+bcast_adv_tx(const uint8_t *data, uint8_t len, void *arg)
+{
+    return bletest_hci_le_set_multi_adv_data((uint8_t *)data, len,
+                                             BCAST_INSTANCE);
+}
+
+/**
+ * Moves the beacon instance to a new advertising interval.  The instance
+ * has to be disabled while its parameters change.
+ */
+static int
+bcast_set_itvl(uint32_t itvl_ms)
+{
+    int rc;
+
+    bcast_params.adv_itvl_min = ADV_ITVL_MS(itvl_ms);
+    bcast_params.adv_itvl_max = ADV_ITVL_MS(itvl_ms);
+
+    rc = bletest_hci_le_set_multi_adv_enable(0, BCAST_INSTANCE);
+    if (rc == 0) {
+        rc = bletest_hci_le_set_multi_adv_params(&bcast_params,
+                                                 BCAST_INSTANCE);
+    }
+    if (rc == 0) {
+        rc = bletest_hci_le_set_multi_adv_enable(1, BCAST_INSTANCE);
+    }
+    return rc;
+}
+
+/**
+ * End of the beacon's fast window.
+ */
+static void
+bcast_sched_ev(struct os_event *ev)
+{
+    int rc;
+
+    if (!bcast_running) {
+        return;
+    }
+    rc = bcast_set_itvl(MYNEWT_VAL(AIRQ_BCAST_SLOW_ITVL_MS));
+    if (rc != 0) {
+        BLEPRPH_LOG(ERROR, "error slowing beacon; rc=%d\n", rc);
+    }
 }
 
 void
@@ -185,42 +316,91 @@ bletest_init_adv_instances(void)
 {
     uint8_t i;
     int rc;
-    uint8_t *addr;
-    uint8_t adv_len;
-    struct hci_multi_adv_params adv;
-
-    /* Start up all the instances */
-        i=1;
-        memset(&adv, 0, sizeof(struct hci_multi_adv_params));
+    struct hci_multi_adv_params *adv;
 
-        adv.own_addr_type = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
-        addr = g_dev_addr;
+    adv = &bcast_params;
 
-        adv.adv_type = BLE_HCI_ADV_TYPE_ADV_NONCONN_IND;
-        adv.adv_channel_map = 0x07;
-        adv.adv_filter_policy = BLE_HCI_ADV_FILT_NONE;
-        adv.peer_addr_type = BLE_HCI_ADV_PEER_ADDR_PUBLIC;
-        adv_len = bletest_set_adv_data(&g_host_adv_data[0], addr);
-
-        adv.adv_itvl_min = 100000 / BLE_HCI_ADV_ITVL;
-        adv.adv_itvl_max = 100000 / BLE_HCI_ADV_ITVL;
-        adv.adv_tx_pwr = 0;
+    /* Start up all the instances */
+        i=BCAST_INSTANCE;
+        memset(adv, 0, sizeof(struct hci_multi_adv_params));
+
+        adv->own_addr_type = BLE_HCI_ADV_OWN_ADDR_PUBLIC;
+
+        adv->adv_type = BLE_HCI_ADV_TYPE_ADV_NONCONN_IND;
+        adv->adv_channel_map = 0x07;
+        adv->adv_filter_policy = BLE_HCI_ADV_FILT_NONE;
+        adv->peer_addr_type = BLE_HCI_ADV_PEER_ADDR_PUBLIC;
+
+        if (MYNEWT_VAL(AIRQ_BCAST_FAST_WINDOW_MS) > 0) {
+            adv->adv_itvl_min =
+                ADV_ITVL_MS(MYNEWT_VAL(AIRQ_BCAST_FAST_ITVL_MS));
+        } else {
+            adv->adv_itvl_min =
+                ADV_ITVL_MS(MYNEWT_VAL(AIRQ_BCAST_SLOW_ITVL_MS));
+        }
+        adv->adv_itvl_max = adv->adv_itvl_min;
+        adv->adv_tx_pwr = 0;
 
         /* Set the advertising parameters */
-        rc = bletest_hci_le_set_multi_adv_params(&adv, i);
+        rc = bletest_hci_le_set_multi_adv_params(adv, i);
         assert(rc == 0);
 
         /* Set advertising data */
-        if (adv_len != 0) {
-            rc = bletest_hci_le_set_multi_adv_data(&g_host_adv_data[0], adv_len,
-                                                   i);
-            assert(rc == 0);
-        }
+        bcast_adv_data_build(adv->adv_tx_pwr);
+        rc = adv_payload_commit(&bcast_adv_data, bcast_adv_tx, NULL);
+        assert(rc == 0);
 
         /* Set the advertising parameters */
         rc = bletest_hci_le_set_multi_adv_enable(1, i);
         assert(rc == 0);
-    
+
+        bcast_running = 1;
+
+        /* Fast for a while, then slow. */
+        if (MYNEWT_VAL(AIRQ_BCAST_FAST_WINDOW_MS) > 0) {
+            os_callout_reset(&bcast_sched_timer,
+                             MYNEWT_VAL(AIRQ_BCAST_FAST_WINDOW_MS) *
+                             OS_TICKS_PER_SEC / 1000);
+        }
+}
+
+/**
+ * Puts a new reading into the beacon's manufacturer data.  The instance
+ * keeps advertising; only the changed bytes are patched and the data is
+ * only sent if the reading or status differ from what is on the air.
+ */
+static void
+bcast_update(uint16_t co2, uint8_t status)
+{
+    const uint8_t *mfg;
+    uint8_t buf[5];
+    int rc;
+
+    if (!bcast_running || bcast_mfg_off < 0) {
+        return;
+    }
+
+    mfg = bcast_adv_data.ap_data + bcast_mfg_off;
+    if (mfg[BCAST_MFG_CO2] == (co2 & 0xff) &&
+        mfg[BCAST_MFG_CO2 + 1] == (co2 >> 8) &&
+        mfg[BCAST_MFG_STATUS] == status) {
+
+        return;
+    }
+
+    bcast_seq++;
+    buf[0] = co2 & 0xff;
+    buf[1] = co2 >> 8;
+    buf[2] = bcast_seq & 0xff;
+    buf[3] = bcast_seq >> 8;
+    buf[4] = status;
+    adv_payload_patch(&bcast_adv_data, bcast_mfg_off + BCAST_MFG_CO2, buf,
+                      sizeof buf);
+
+    rc = adv_payload_commit(&bcast_adv_data, bcast_adv_tx, NULL);
+    if (rc != 0) {
+        BLEPRPH_LOG(ERROR, "error updating beacon data; rc=%d\n", rc);
+    }
 }
 
 /**
@@ -243,51 +423,65 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
 {
     struct ble_gap_conn_desc desc;
     int rc;
+    int sns;
 
     switch (event->type) {
     case BLE_GAP_EVENT_CONNECT:
         /* A new connection was established or a connection attempt failed. */
-        BLEPRPH_LOG(INFO, "connection %s; status=%d ",
-                       event->connect.status == 0 ? "established" : "failed",
-                       event->connect.status);
         if (event->connect.status == 0) {
             rc = ble_gap_conn_find(event->connect.conn_handle, &desc);
             assert(rc == 0);
-            bleprph_print_conn_desc(&desc);
+            trace_conn(event->type, event->connect.status, &desc);
+            connparam_connected(event->connect.conn_handle);
+        } else {
+            trace_conn(event->type, event->connect.status, NULL);
         }
-        BLEPRPH_LOG(INFO, "\n");
 
-        /* Start advertising again. */
-        bleprph_advertise();
+        /* Keep advertising for other centrals.  A failed attempt means the
+         * central is still looking for us, so keep it quick.
+         */
+        if (event->connect.status == 0) {
+            bleprph_advertise(BLEPRPH_ADV_SLOW);
+        } else {
+            bleprph_advertise(BLEPRPH_ADV_FAST);
+        }
         return 0;
 
     case BLE_GAP_EVENT_DISCONNECT:
-        BLEPRPH_LOG(INFO, "disconnect; reason=%d ", event->disconnect.reason);
-        bleprph_print_conn_desc(&event->disconnect.conn);
-        BLEPRPH_LOG(INFO, "\n");
+        trace_conn(event->type, event->disconnect.reason,
+                   &event->disconnect.conn);
+
+        gatt_svr_conn_broken(event->disconnect.conn.conn_handle);
+        connparam_disconnected(event->disconnect.conn.conn_handle);
+
+        /* Connection terminated; advertise fast so the central can come
+         * right back.
+         */
+        bleprph_advertise(BLEPRPH_ADV_FAST);
+        return 0;
 
-        /* Connection terminated; resume advertising. */
-        bleprph_advertise();
+    case BLE_GAP_EVENT_ADV_COMPLETE:
+        /* The fast window is over; carry on slowly. */
+        BLEPRPH_LOG(INFO, "advertise complete; reason=%d\n",
+                    event->adv_complete.reason);
+        bleprph_advertise(BLEPRPH_ADV_SLOW);
         return 0;
 
     case BLE_GAP_EVENT_CONN_UPDATE:
         /* The central has updated the connection parameters. */
-        BLEPRPH_LOG(INFO, "connection updated; status=%d ",
-                    event->conn_update.status);
-        rc = ble_gap_conn_find(event->connect.conn_handle, &desc);
+        rc = ble_gap_conn_find(event->conn_update.conn_handle, &desc);
         assert(rc == 0);
-        bleprph_print_conn_desc(&desc);
-        BLEPRPH_LOG(INFO, "\n");
+        trace_conn(event->type, event->conn_update.status, &desc);
+
+        connparam_updated(event->conn_update.conn_handle,
+                          event->conn_update.status);
         return 0;
 
     case BLE_GAP_EVENT_ENC_CHANGE:
         /* Encryption has been enabled or disabled for this connection. */
-        BLEPRPH_LOG(INFO, "encryption change event; status=%d ",
-                    event->enc_change.status);
-        rc = ble_gap_conn_find(event->connect.conn_handle, &desc);
+        rc = ble_gap_conn_find(event->enc_change.conn_handle, &desc);
         assert(rc == 0);
-        bleprph_print_conn_desc(&desc);
-        BLEPRPH_LOG(INFO, "\n");
+        trace_conn(event->type, event->enc_change.status, &desc);
         return 0;
 
     case BLE_GAP_EVENT_SUBSCRIBE:
@@ -300,6 +494,23 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
                     event->subscribe.cur_notify,
                     event->subscribe.prev_indicate,
                     event->subscribe.cur_indicate);
+
+        sns = gatt_svr_subscribe(event->subscribe.conn_handle,
+                                 event->subscribe.attr_handle,
+                                 event->subscribe.cur_notify ||
+                                 event->subscribe.cur_indicate);
+        if (sns == GATT_SVR_SNS_CO2 &&
+            gatt_svr_sns_subscribers(GATT_SVR_SNS_CO2) == 1) {
+
+            /* First listener; get it a fresh reading soon. */
+            sampler_adapt_init(&co2_adapt);
+            sampler_job_set_period(&co2_job, CO2_SAMPLE_ITVL);
+        }
+        return 0;
+
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        gatt_svr_notify_tx(event->notify_tx.conn_handle,
+                           event->notify_tx.attr_handle);
         return 0;
 
     case BLE_GAP_EVENT_MTU:
@@ -307,6 +518,7 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
                     event->mtu.conn_handle,
                     event->mtu.channel_id,
                     event->mtu.value);
+        connparam_mtu(event->mtu.conn_handle, event->mtu.value);
         return 0;
     }
 
@@ -317,51 +529,76 @@ static void
 bleprph_on_reset(int reason)
 {
     BLEPRPH_LOG(ERROR, "Resetting state; reason=%d\n", reason);
+
+    /* The controller lost the beacon instance along with everything else. */
+    bcast_running = 0;
+    os_callout_stop(&bcast_sched_timer);
 }
 
 static void
 bleprph_on_sync(void)
 {
+    connparam_sync();
+    bleprph_adv_data_build();
     bletest_init_adv_instances();
     /* Begin advertising. */
-    bleprph_advertise();
+    bleprph_advertise(BLEPRPH_ADV_FAST);
+}
+
+static void
+co2_read_cb(struct senseair *s, int status, const struct senseair_sample *ss,
+            void *arg)
+{
+    if (status != 0) {
+        trace_sample(status, 0, 0);
+        bcast_update(gatt_co2_val, BCAST_STATUS_F_READ_ERR);
+        return;
+    }
+    trace_sample(0, ss->ss_co2, ss->ss_status);
+    gatt_co2_val = ss->ss_co2;
+    bcast_update(ss->ss_co2, ss->ss_status & ~BCAST_STATUS_F_READ_ERR);
+    history_add(ss->ss_co2, ss->ss_status);
+    slog_add(ss->ss_co2, ss->ss_status);
+
+    /* With nobody subscribed, back off as far as the idle interval; a
+     * change still speeds sampling up for the beacon and the logs.
+     */
+    if (gatt_svr_sns_subscribers(GATT_SVR_SNS_CO2) == 0) {
+        sampler_adapt_set_slow(&co2_adapt, &co2_job, CO2_SAMPLE_IDLE_ITVL);
+    } else {
+        sampler_adapt_set_slow(&co2_adapt, &co2_job, 0);
+    }
+    sampler_adapt_update(&co2_adapt, &co2_job, ss->ss_co2);
+
+    /* Nobody to tell; skip the notification. */
+    if (gatt_svr_sns_subscribers(GATT_SVR_SNS_CO2) == 0) {
+        return;
+    }
+    if (gatt_svr_sns_triggered(GATT_SVR_SNS_CO2, ss->ss_co2)) {
+        ble_gatts_chr_updated(gatt_svr_sns_val_handle(GATT_SVR_SNS_CO2));
+    }
 }
 
 int
 co2_read_event(void)
 {
-    int value;
-    enum senseair_read_type type = SENSEAIR_CO2;
-    uint16_t chr_val_handle;
     int rc;
 
-    value = senseair_read(type);
-    if (value >= 0) {
-        console_printf("Got %d\n", value);
-    } else {
-        console_printf("Error while reading: %d\n", value);
-        goto err;
+    rc = senseair_read_async(co2_sensor, SENSEAIR_ALL, co2_read_cb, NULL);
+    if (rc) {
+        trace_sample(rc, 0, 0);
     }
-    gatt_co2_val = value;
-    rc = ble_gatts_find_chr(&gatt_svr_svc_co2_uuid.u, BLE_UUID16_DECLARE(CO2_SNS_VAL), NULL, &chr_val_handle);
-    assert(rc == 0);
-    ble_gatts_chr_updated(chr_val_handle);
-    return (0);
-err:
-    return (rc);
+    return rc;
 }
 
 /**
- * Event loop for the sensor task.
+ * Kicks off a new sample each time the co2 job comes due.  The result is
+ * delivered to co2_read_cb() through the default event queue.
  */
 static void
-co2_task_handler(void *unused)
+co2_sample_job(struct sampler_job *job)
 {
-    while (1) {
-        co2_read_event();
-        /* Wait 2 second */
-        os_time_delay(OS_TICKS_PER_SEC * 2);
-    }
+    co2_read_event();
 }
 
 /**
@@ -384,23 +621,30 @@ main(int argc, char **argv)
     /* Initialize OS */
     sysinit();
 
-    /* Initialize co2 sensor task eventq */
-    os_eventq_init(&co2_evq);
-
     /* Senseair init */
-    senseair_init(0);
+    rc = senseair_init(MYNEWT_VAL(AIRQ_SENSOR_UART), &co2_sensor);
+    assert(rc == 0);
+    senseair_evq_set(co2_sensor, os_eventq_dflt_get());
 
-    /* Create the CO2 reader task.  
-     * All sensor operations are performed in this task.
+    /* Sensors are sampled from the default event queue; no task of their
+     * own.
      */
-    os_task_init(&co2_task, "sensor", co2_task_handler,
-            NULL, CO2_TASK_PRIO, OS_WAIT_FOREVER,
-            co2_stack, CO2_STACK_SIZE);
+    sampler_init(os_eventq_dflt_get());
+    sampler_adapt_init(&co2_adapt);
+    rc = sampler_job_add(&co2_job);
+    assert(rc == 0);
+    sampler_start();
 
     /* Initialize the bleprph log. */
     log_register("bleprph", &bleprph_log, &log_console_handler, NULL,
                  LOG_SYSLEVEL);
 
+    /* Sensor reads and connection events are traced in RAM; "trace" in
+     * the shell prints them.
+     */
+    rc = trace_init();
+    assert(rc == 0);
+
     /* Initialize the NimBLE host configuration. */
     log_register("ble_hs", &ble_hs_log, &log_console_handler, NULL,
                  LOG_SYSLEVEL);
@@ -411,6 +655,19 @@ main(int argc, char **argv)
     rc = gatt_svr_init();
     assert(rc == 0);
 
+    os_callout_init(&bcast_sched_timer, os_eventq_dflt_get(),
+                    bcast_sched_ev, NULL);
+    connparam_init();
+
+    rc = upgrade_init();
+    assert(rc == 0);
+
+    /* Persistent sample log; the beacon keeps running without it. */
+    rc = slog_init();
+    if (rc != 0) {
+        BLEPRPH_LOG(ERROR, "sample log unavailable; rc=%d\n", rc);
+    }
+
     /* Set the default device name. */
     rc = ble_svc_gap_device_name_set("nimble-cleantech");
     assert(rc == 0);
@@ -0,0 +1,220 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include "os/os.h"
+#include "syscfg/syscfg.h"
+#include "sampler.h"
+
+#define SAMPLER_MS_TO_TICKS(ms) \
+    ((os_time_t)((uint64_t)(ms) * OS_TICKS_PER_SEC / 1000))
+
+static struct os_eventq *sampler_evq;
+static SLIST_HEAD(, sampler_job) sampler_jobs =
+    SLIST_HEAD_INITIALIZER(sampler_jobs);
+static int sampler_started;
+
+/**
+ * Arms the job's timer for its current deadline.  Deadlines advance by a
+ * whole period each run, so time spent in the job does not accumulate as
+ * drift.
+ */
+static void
+sampler_job_arm(struct sampler_job *job)
+{
+    os_stime_t delta;
+
+    delta = (os_stime_t)(job->sj_deadline - os_time_get());
+    if (delta < 0) {
+        /* We fell behind; skip the missed runs rather than bursting. */
+        job->sj_deadline = os_time_get();
+        delta = 0;
+    }
+    os_callout_reset(&job->sj_timer, delta);
+}
+
+static void
+sampler_job_ev(struct os_event *ev)
+{
+    struct sampler_job *job;
+
+    job = ev->ev_arg;
+
+    job->sj_deadline += job->sj_period;
+    sampler_job_arm(job);
+
+    job->sj_fn(job);
+}
+
+static void
+sampler_job_begin(struct sampler_job *job, os_time_t now)
+{
+    job->sj_deadline = now + job->sj_phase;
+    sampler_job_arm(job);
+}
+
+void
+sampler_init(struct os_eventq *evq)
+{
+    sampler_evq = evq;
+}
+
+int
+sampler_job_add(struct sampler_job *job)
+{
+    assert(sampler_evq != NULL);
+
+    if (job->sj_fn == NULL || job->sj_period == 0) {
+        return -1;
+    }
+
+    os_callout_init(&job->sj_timer, sampler_evq, sampler_job_ev, job);
+    SLIST_INSERT_HEAD(&sampler_jobs, job, sj_next);
+
+    if (sampler_started) {
+        sampler_job_begin(job, os_time_get());
+    }
+    return 0;
+}
+
+/**
+ * Changes the period of a job.  The next run is rescheduled relative to
+ * the previous one, so a shorter period takes effect immediately.
+ */
+void
+sampler_job_set_period(struct sampler_job *job, os_time_t period)
+{
+    assert(period != 0);
+
+    if (job->sj_period == period) {
+        return;
+    }
+    if (sampler_started) {
+        job->sj_deadline = job->sj_deadline - job->sj_period + period;
+        sampler_job_arm(job);
+    }
+    job->sj_period = period;
+}
+
+void
+sampler_start(void)
+{
+    struct sampler_job *job;
+    os_time_t now;
+
+    if (sampler_started) {
+        return;
+    }
+    sampler_started = 1;
+
+    now = os_time_get();
+    SLIST_FOREACH(job, &sampler_jobs, sj_next) {
+        sampler_job_begin(job, now);
+    }
+}
+
+void
+sampler_adapt_init(struct sampler_adapt *sa)
+{
+    sa->sa_valid = 0;
+    sa->sa_stable = 0;
+    sa->sa_slow = 0;
+}
+
+/**
+ * Sets the longest period the policy backs off to, in OS ticks; 0 restores
+ * AIRQ_SAMPLE_SLOW_MS.  A job already slower than that is sped up.
+ */
+void
+sampler_adapt_set_slow(struct sampler_adapt *sa, struct sampler_job *job,
+                       os_time_t slow)
+{
+    sa->sa_slow = slow;
+    if (slow != 0 && job->sj_period > slow) {
+        sampler_job_set_period(job, slow);
+    }
+}
+
+/**
+ * Feeds a new reading to the adaptive policy and adjusts the job's period
+ * to match.
+ */
+void
+sampler_adapt_update(struct sampler_adapt *sa, struct sampler_job *job,
+                     int32_t value)
+{
+    os_time_t fast;
+    os_time_t slow;
+    os_time_t now;
+    os_time_t period;
+    uint32_t dt;
+    int32_t delta;
+    int stable;
+    int busy;
+
+    fast = SAMPLER_MS_TO_TICKS(MYNEWT_VAL(AIRQ_SAMPLE_FAST_MS));
+    slow = sa->sa_slow;
+    if (slow == 0) {
+        slow = SAMPLER_MS_TO_TICKS(MYNEWT_VAL(AIRQ_SAMPLE_SLOW_MS));
+    }
+    now = os_time_get();
+
+    busy = 0;
+    stable = 0;
+    if (sa->sa_valid) {
+        delta = abs(value - sa->sa_prev);
+        dt = now - sa->sa_prev_time;
+        if (delta <= MYNEWT_VAL(AIRQ_SAMPLE_NOISE_PPM)) {
+            stable = 1;
+        } else if (delta >= MYNEWT_VAL(AIRQ_SAMPLE_DELTA_PPM)) {
+            busy = 1;
+        } else if (dt != 0 &&
+          (uint64_t)delta * 60 * OS_TICKS_PER_SEC / dt >=
+          MYNEWT_VAL(AIRQ_SAMPLE_SLOPE_PPM_MIN)) {
+            busy = 1;
+        }
+    }
+    sa->sa_prev = value;
+    sa->sa_prev_time = now;
+    sa->sa_valid = 1;
+
+    if (busy) {
+        sa->sa_stable = 0;
+        period = fast;
+    } else if (!stable) {
+        /* Moving, but not enough to speed up; hold the period and start
+         * counting stable samples over.
+         */
+        sa->sa_stable = 0;
+        period = job->sj_period;
+    } else if (++sa->sa_stable >= MYNEWT_VAL(AIRQ_SAMPLE_STABLE_COUNT)) {
+        sa->sa_stable = 0;
+        period = job->sj_period * 2;
+        if (period > slow) {
+            period = slow;
+        }
+    } else {
+        period = job->sj_period;
+    }
+    if (period < fast) {
+        period = fast;
+    }
+    sampler_job_set_period(job, period);
+}
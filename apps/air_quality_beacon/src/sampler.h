@@ -0,0 +1,83 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef H_SAMPLER_
+#define H_SAMPLER_
+
+#include "os/os.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sampler_job;
+
+typedef void sampler_job_fn(struct sampler_job *job);
+
+/**
+ * A periodic sampling job.  All jobs run from the event queue passed to
+ * sampler_init(); none of them get a task of their own.
+ */
+struct sampler_job {
+    /** Called once per period. */
+    sampler_job_fn *sj_fn;
+    void *sj_arg;
+
+    /** Interval between runs, in OS ticks. */
+    os_time_t sj_period;
+
+    /** Delay of the first run after sampler_start(), in OS ticks. */
+    os_time_t sj_phase;
+
+    /* Private. */
+    os_time_t sj_deadline;
+    struct os_callout sj_timer;
+    SLIST_ENTRY(sampler_job) sj_next;
+};
+
+/**
+ * Adaptive period for a job sampling a slowly changing value: the period
+ * doubles while readings stay within the noise band, up to the slow
+ * limit, and drops back to the fast one on a big jump or steep slope.
+ * Limits and thresholds come from the AIRQ_SAMPLE_* syscfg settings; the
+ * slow limit can be changed with sampler_adapt_set_slow().
+ */
+struct sampler_adapt {
+    int32_t sa_prev;
+    os_time_t sa_prev_time;
+    os_time_t sa_slow;
+    uint8_t sa_valid;
+    uint8_t sa_stable;
+};
+
+void sampler_init(struct os_eventq *evq);
+int sampler_job_add(struct sampler_job *job);
+void sampler_job_set_period(struct sampler_job *job, os_time_t period);
+void sampler_start(void);
+
+void sampler_adapt_init(struct sampler_adapt *sa);
+void sampler_adapt_set_slow(struct sampler_adapt *sa,
+                            struct sampler_job *job, os_time_t slow);
+void sampler_adapt_update(struct sampler_adapt *sa, struct sampler_job *job,
+                          int32_t value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
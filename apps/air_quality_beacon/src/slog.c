@@ -0,0 +1,538 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "os/os.h"
+#include "syscfg/syscfg.h"
+#include "sysflash/sysflash.h"
+#include "flash_map/flash_map.h"
+#include "fcb/fcb.h"
+#include "shell/shell.h"
+#include "console/console.h"
+#include "mgmt/mgmt.h"
+#include "cborattr/cborattr.h"
+#include "bleprph.h"
+#include "history.h"
+#include "slog.h"
+
+/*
+ * A block is one FCB entry:
+ *     <varint boot> <varint seq of the first record> <record>...
+ * and a record is:
+ *     <varint time delta> <zigzag varint co2 delta> <status>
+ * with deltas taken from the previous record in the block, or from 0 for
+ * the first one.  At a sample a minute, a record is three bytes.
+ */
+#define SLOG_MAGIC          0x534c4f47
+#define SLOG_VERSION        1
+#define SLOG_BLOCK_LEN      MYNEWT_VAL(AIRQ_SLOG_BLOCK_LEN)
+#define SLOG_HDR_MAX        10
+#define SLOG_REC_MAX        9
+#define SLOG_REC_MIN        3
+
+/* Most records a block can hold: the most that a reset can lose. */
+#define SLOG_BLOCK_RECS     (SLOG_BLOCK_LEN / SLOG_REC_MIN)
+
+#define SLOG_FLUSH_TICKS \
+    ((os_time_t)((uint64_t)MYNEWT_VAL(AIRQ_SLOG_FLUSH_MS) * \
+                 OS_TICKS_PER_SEC / 1000))
+
+static struct flash_area slog_sectors[MYNEWT_VAL(AIRQ_SLOG_MAX_SECTORS)];
+static struct fcb slog_fcb;
+
+static uint8_t slog_blk[SLOG_BLOCK_LEN];
+static uint16_t slog_blk_len;
+static uint32_t slog_blk_time;
+static uint16_t slog_blk_co2;
+
+static int slog_ready;
+static uint32_t slog_cur_boot;
+static uint32_t slog_seq;
+static struct os_callout slog_flush_timer;
+
+/* Guards the RAM block and the FCB: samples are added from the default
+ * task, while the shell and newtmgr read and flush from their own.
+ */
+static struct os_mutex slog_mtx;
+
+static int slog_shell_func(int argc, char **argv);
+static struct shell_cmd slog_cmd = {
+    .sc_cmd = "slog",
+    .sc_cmd_func = slog_shell_func,
+};
+
+static int slog_nmgr_read(struct mgmt_cbuf *cb);
+static int slog_nmgr_flush(struct mgmt_cbuf *cb);
+
+#define SLOG_NMGR_ID_READ   0
+#define SLOG_NMGR_ID_FLUSH  1
+
+static const struct mgmt_handler slog_nmgr_handlers[] = {
+    [SLOG_NMGR_ID_READ] = { slog_nmgr_read, NULL },
+    [SLOG_NMGR_ID_FLUSH] = { NULL, slog_nmgr_flush },
+};
+
+static struct mgmt_group slog_nmgr_group = {
+    .mg_handlers = slog_nmgr_handlers,
+    .mg_handlers_count = sizeof(slog_nmgr_handlers) /
+                         sizeof(slog_nmgr_handlers[0]),
+    .mg_group_id = MYNEWT_VAL(AIRQ_SLOG_NMGR_GROUP),
+};
+
+static int
+slog_put_varint(uint8_t *buf, uint32_t val)
+{
+    int len;
+
+    len = 0;
+    while (val >= 0x80) {
+        buf[len++] = val | 0x80;
+        val >>= 7;
+    }
+    buf[len++] = val;
+    return len;
+}
+
+static int
+slog_get_varint(struct slog_cursor *c, uint32_t *val)
+{
+    uint8_t b;
+    int shift;
+
+    *val = 0;
+    for (shift = 0; shift < 35; shift += 7) {
+        if (c->sc_off >= c->sc_len) {
+            return -1;
+        }
+        b = c->sc_buf[c->sc_off++];
+        *val |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void
+slog_lock(void)
+{
+    os_mutex_pend(&slog_mtx, OS_TIMEOUT_NEVER);
+}
+
+static void
+slog_unlock(void)
+{
+    os_mutex_release(&slog_mtx);
+}
+
+static int
+slog_flush_locked(void)
+{
+    struct fcb_entry loc;
+    int rc;
+
+    os_callout_stop(&slog_flush_timer);
+    if (slog_blk_len == 0) {
+        return 0;
+    }
+    if (!slog_ready) {
+        slog_blk_len = 0;
+        return FCB_ERR_ARGS;
+    }
+
+    rc = fcb_append(&slog_fcb, slog_blk_len, &loc);
+    if (rc == FCB_ERR_NOSPACE) {
+        rc = fcb_rotate(&slog_fcb);
+        if (rc == 0) {
+            rc = fcb_append(&slog_fcb, slog_blk_len, &loc);
+        }
+    }
+    if (rc == 0) {
+        rc = flash_area_write(loc.fe_area, loc.fe_data_off, slog_blk,
+                              slog_blk_len);
+    }
+    if (rc == 0) {
+        rc = fcb_append_finish(&slog_fcb, &loc);
+    }
+    if (rc != 0) {
+        BLEPRPH_LOG(ERROR, "slog: block write failed; rc=%d\n", rc);
+    }
+
+    /* A block that could not be written is dropped, not retried; the
+     * samples in it are still in the RAM history.
+     */
+    slog_blk_len = 0;
+    return rc;
+}
+
+/**
+ * Writes the RAM block out to flash.  When the flash area is full, the
+ * oldest sector is erased first.
+ */
+int
+slog_flush(void)
+{
+    int rc;
+
+    slog_lock();
+    rc = slog_flush_locked();
+    slog_unlock();
+    return rc;
+}
+
+static void
+slog_flush_timer_ev(struct os_event *ev)
+{
+    slog_flush();
+}
+
+/**
+ * Adds a sample to the log.
+ */
+int
+slog_add(uint16_t co2, uint8_t status)
+{
+    uint32_t now;
+    int32_t d;
+    int rc;
+
+    slog_lock();
+    rc = 0;
+    if (slog_blk_len + SLOG_REC_MAX > SLOG_BLOCK_LEN) {
+        rc = slog_flush_locked();
+    }
+
+    now = history_now();
+    if (slog_blk_len == 0) {
+        slog_blk_len += slog_put_varint(slog_blk, slog_cur_boot);
+        slog_blk_len += slog_put_varint(slog_blk + slog_blk_len, slog_seq);
+        slog_blk_time = 0;
+        slog_blk_co2 = 0;
+        os_callout_reset(&slog_flush_timer, SLOG_FLUSH_TICKS);
+    }
+
+    d = (int32_t)co2 - slog_blk_co2;
+    slog_blk_len += slog_put_varint(slog_blk + slog_blk_len,
+                                    now - slog_blk_time);
+    slog_blk_len += slog_put_varint(slog_blk + slog_blk_len,
+                                    ((uint32_t)d << 1) ^ (d >> 31));
+    slog_blk[slog_blk_len++] = status;
+
+    slog_blk_time = now;
+    slog_blk_co2 = co2;
+    slog_seq++;
+    slog_unlock();
+
+    return rc;
+}
+
+uint32_t
+slog_next_seq(void)
+{
+    return slog_seq;
+}
+
+uint32_t
+slog_boot(void)
+{
+    return slog_cur_boot;
+}
+
+/**
+ * Starts a cursor at the oldest record with a sequence number of at least
+ * seq.
+ */
+void
+slog_cursor_init(struct slog_cursor *c, uint32_t seq)
+{
+    memset(&c->sc_loc, 0, sizeof c->sc_loc);
+    c->sc_min_seq = seq;
+    c->sc_ram = 0;
+    c->sc_len = 0;
+    c->sc_off = 0;
+}
+
+static int
+slog_cursor_load(struct slog_cursor *c)
+{
+    int rc;
+
+    if (c->sc_ram) {
+        return SLOG_EDONE;
+    }
+
+    rc = fcb_getnext(&slog_fcb, &c->sc_loc);
+    if (rc == FCB_ERR_NOVAR) {
+        /* Past the last block in flash; finish with the RAM block. */
+        c->sc_ram = 1;
+        c->sc_len = slog_blk_len;
+        memcpy(c->sc_buf, slog_blk, slog_blk_len);
+    } else if (rc == 0) {
+        c->sc_len = c->sc_loc.fe_data_len;
+        if (c->sc_len > SLOG_BLOCK_LEN) {
+            c->sc_len = 0;
+        }
+        rc = flash_area_read(c->sc_loc.fe_area, c->sc_loc.fe_data_off,
+                             c->sc_buf, c->sc_len);
+        if (rc != 0) {
+            c->sc_len = 0;
+        }
+    } else {
+        return rc;
+    }
+
+    c->sc_off = 0;
+    if (slog_get_varint(c, &c->sc_rec.sr_boot) ||
+        slog_get_varint(c, &c->sc_seq)) {
+
+        c->sc_len = 0;
+    }
+    c->sc_rec.sr_time = 0;
+    c->sc_rec.sr_co2 = 0;
+    return 0;
+}
+
+/**
+ * Reads the next record.  The log is locked while it runs, so the block
+ * not yet flushed is copied whole.
+ *
+ * @return                      0 on success;
+ *                              SLOG_EDONE at the end of the log;
+ *                              FCB error code on failure.
+ */
+int
+slog_cursor_next(struct slog_cursor *c, struct slog_rec *out)
+{
+    struct slog_rec *rec;
+    uint32_t dt;
+    uint32_t zz;
+    int rc;
+
+    rec = &c->sc_rec;
+    slog_lock();
+    for (;;) {
+        while (c->sc_off < c->sc_len) {
+            if (slog_get_varint(c, &dt) || slog_get_varint(c, &zz) ||
+                c->sc_off >= c->sc_len) {
+
+                /* Truncated block; skip the rest of it. */
+                c->sc_off = c->sc_len;
+                break;
+            }
+            rec->sr_time += dt;
+            rec->sr_co2 += (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+            rec->sr_status = c->sc_buf[c->sc_off++];
+            rec->sr_seq = c->sc_seq++;
+
+            if (rec->sr_seq >= c->sc_min_seq) {
+                *out = *rec;
+                slog_unlock();
+                return 0;
+            }
+        }
+
+        rc = slog_cursor_load(c);
+        if (rc != 0) {
+            slog_unlock();
+            return rc;
+        }
+    }
+}
+
+static int
+slog_shell_func(int argc, char **argv)
+{
+    static struct slog_cursor c;
+    struct slog_rec rec;
+    uint32_t seq;
+    int cnt;
+    int rc;
+
+    if (argc >= 2 && !strcmp(argv[1], "flush")) {
+        rc = slog_flush();
+        console_printf("flush rc=%d\n", rc);
+        return 0;
+    }
+    if (argc >= 2 && !strcmp(argv[1], "info")) {
+        console_printf("boot %lu next seq %lu pending %d bytes\n",
+                       (unsigned long)slog_cur_boot,
+                       (unsigned long)slog_seq, slog_blk_len);
+        return 0;
+    }
+    if (argc < 2 || strcmp(argv[1], "dump")) {
+        console_printf("%s dump [seq] [count] | flush | info\n", argv[0]);
+        return 0;
+    }
+
+    seq = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+    cnt = argc > 3 ? atoi(argv[3]) : 20;
+
+    slog_cursor_init(&c, seq);
+    while (cnt-- > 0) {
+        rc = slog_cursor_next(&c, &rec);
+        if (rc != 0) {
+            break;
+        }
+        console_printf("%lu boot %lu time %lu co2 %d status 0x%02x\n",
+                       (unsigned long)rec.sr_seq, (unsigned long)rec.sr_boot,
+                       (unsigned long)rec.sr_time, rec.sr_co2,
+                       rec.sr_status);
+    }
+    return 0;
+}
+
+/**
+ * newtmgr read: {"seq": N} returns up to AIRQ_SLOG_NMGR_MAX records from
+ * sequence number N as "recs": [[seq, boot, time, co2, status], ...], and
+ * in "next" the sequence number to ask for next.
+ */
+static int
+slog_nmgr_read(struct mgmt_cbuf *cb)
+{
+    static struct slog_cursor c;
+    struct slog_rec rec;
+    long long unsigned int seq;
+    CborEncoder recs;
+    CborEncoder arr;
+    int rc;
+    int i;
+
+    const struct cbor_attr_t attrs[] = {
+        {
+            .attribute = "seq",
+            .type = CborAttrUnsignedIntegerType,
+            .addr.uinteger = &seq,
+            .nodefault = 1,
+        }, {
+            .attribute = NULL
+        }
+    };
+
+    seq = 0;
+    rc = cbor_read_object(&cb->it, attrs);
+    if (rc != 0) {
+        return MGMT_ERR_EINVAL;
+    }
+
+    slog_cursor_init(&c, seq);
+
+    cbor_encode_text_stringz(&cb->encoder, "rc");
+    cbor_encode_int(&cb->encoder, MGMT_ERR_EOK);
+    cbor_encode_text_stringz(&cb->encoder, "boot");
+    cbor_encode_uint(&cb->encoder, slog_cur_boot);
+    cbor_encode_text_stringz(&cb->encoder, "recs");
+    cbor_encoder_create_array(&cb->encoder, &recs, CborIndefiniteLength);
+    for (i = 0; i < MYNEWT_VAL(AIRQ_SLOG_NMGR_MAX); i++) {
+        if (slog_cursor_next(&c, &rec) != 0) {
+            break;
+        }
+        cbor_encoder_create_array(&recs, &arr, 5);
+        cbor_encode_uint(&arr, rec.sr_seq);
+        cbor_encode_uint(&arr, rec.sr_boot);
+        cbor_encode_uint(&arr, rec.sr_time);
+        cbor_encode_uint(&arr, rec.sr_co2);
+        cbor_encode_uint(&arr, rec.sr_status);
+        cbor_encoder_close_container(&recs, &arr);
+        seq = rec.sr_seq + 1;
+    }
+    cbor_encoder_close_container(&cb->encoder, &recs);
+    cbor_encode_text_stringz(&cb->encoder, "next");
+    cbor_encode_uint(&cb->encoder, seq);
+
+    return 0;
+}
+
+static int
+slog_nmgr_flush(struct mgmt_cbuf *cb)
+{
+    int rc;
+
+    rc = slog_flush();
+    cbor_encode_text_stringz(&cb->encoder, "rc");
+    cbor_encode_int(&cb->encoder, rc == 0 ? MGMT_ERR_EOK : MGMT_ERR_EUNKNOWN);
+    return 0;
+}
+
+/**
+ * Opens the log, erasing the flash area if it does not hold one, and picks
+ * up the boot and sequence numbers where the previous boot left them.
+ */
+int
+slog_init(void)
+{
+    static struct slog_cursor c;
+    struct slog_rec rec;
+    int cnt;
+    int rc;
+    int i;
+
+    os_mutex_init(&slog_mtx);
+    os_callout_init(&slog_flush_timer, os_eventq_dflt_get(),
+                    slog_flush_timer_ev, NULL);
+
+    cnt = MYNEWT_VAL(AIRQ_SLOG_MAX_SECTORS);
+    rc = flash_area_to_sectors(MYNEWT_VAL(AIRQ_SLOG_FLASH_AREA), &cnt,
+                               NULL);
+    if (rc != 0 || cnt > MYNEWT_VAL(AIRQ_SLOG_MAX_SECTORS) || cnt < 2) {
+        return -1;
+    }
+    flash_area_to_sectors(MYNEWT_VAL(AIRQ_SLOG_FLASH_AREA), &cnt,
+                          slog_sectors);
+
+    slog_fcb.f_magic = SLOG_MAGIC;
+    slog_fcb.f_version = SLOG_VERSION;
+    slog_fcb.f_sector_cnt = cnt;
+    slog_fcb.f_scratch_cnt = 0;
+    slog_fcb.f_sectors = slog_sectors;
+
+    rc = fcb_init(&slog_fcb);
+    if (rc != 0) {
+        /* Not a sample log, or an older format; start over. */
+        for (i = 0; i < cnt; i++) {
+            flash_area_erase(&slog_sectors[i], 0, slog_sectors[i].fa_size);
+        }
+        rc = fcb_init(&slog_fcb);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    slog_cursor_init(&c, 0);
+    while (slog_cursor_next(&c, &rec) == 0) {
+        slog_cur_boot = rec.sr_boot + 1;
+        slog_seq = rec.sr_seq + 1;
+    }
+
+    /* Samples the previous boot had not flushed are gone, but a reader may
+     * already have seen their sequence numbers; never hand those out
+     * again.
+     */
+    if (slog_cur_boot != 0) {
+        slog_seq += SLOG_BLOCK_RECS;
+    }
+    slog_ready = 1;
+
+    rc = shell_cmd_register(&slog_cmd);
+    if (rc != 0) {
+        return rc;
+    }
+    return mgmt_group_register(&slog_nmgr_group);
+}
@@ -0,0 +1,82 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+*/
+
+#ifndef H_SLOG_
+#define H_SLOG_
+
+#include <inttypes.h>
+#include "syscfg/syscfg.h"
+#include "fcb/fcb.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Flash sample log.  CO2 samples are delta-encoded into a RAM block which
+ * is appended to a flash circular buffer (FCB) when full, or when
+ * AIRQ_SLOG_FLUSH_MS has passed since its first sample.  Once the flash
+ * area is full, the oldest sector is erased to make room.
+ *
+ * Sequence numbers keep counting across reboots, skipping ahead by a
+ * block's worth at each boot past any the previous boot may have used
+ * without flushing.  Sample times are seconds since boot, so each record
+ * also carries the number of the boot it was taken in.
+ */
+
+#define SLOG_EDONE      1
+
+struct slog_rec {
+    uint32_t sr_seq;
+    uint32_t sr_boot;
+    uint32_t sr_time;
+    uint16_t sr_co2;
+    uint8_t sr_status;
+};
+
+/**
+ * Position in the log.  A cursor walks the blocks in flash, oldest first,
+ * and then the block not yet flushed.  It is only valid until the log is
+ * next written to; use the sequence number of the last record read to
+ * start a new one.
+ */
+struct slog_cursor {
+    struct fcb_entry sc_loc;
+    uint32_t sc_min_seq;
+    uint32_t sc_seq;
+    uint8_t sc_ram;
+    uint16_t sc_len;
+    uint16_t sc_off;
+    struct slog_rec sc_rec;
+    uint8_t sc_buf[MYNEWT_VAL(AIRQ_SLOG_BLOCK_LEN)];
+};
+
+int slog_init(void);
+int slog_add(uint16_t co2, uint8_t status);
+int slog_flush(void);
+uint32_t slog_next_seq(void);
+uint32_t slog_boot(void);
+
+void slog_cursor_init(struct slog_cursor *c, uint32_t seq);
+int slog_cursor_next(struct slog_cursor *c, struct slog_rec *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,215 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include "os/os.h"
+#include "syscfg/syscfg.h"
+#include "cbmem/cbmem.h"
+#include "shell/shell.h"
+#include "console/console.h"
+#include "host/ble_hs.h"
+#include "trace.h"
+
+union trace_rec {
+    uint8_t type;
+    struct trace_sample sample;
+    struct trace_conn conn;
+};
+
+struct log trace_log;
+
+static uint32_t trace_buf[MYNEWT_VAL(AIRQ_TRACE_BUF_SIZE) / 4];
+static struct cbmem trace_cbmem;
+
+static int trace_shell_func(int argc, char **argv);
+static struct shell_cmd trace_cmd = {
+    .sc_cmd = "trace",
+    .sc_cmd_func = trace_shell_func,
+};
+
+/**
+ * Writes one record, header space included, with a single log append.
+ */
+static void
+trace_append(int level, const void *rec, int len)
+{
+    uint8_t buf[LOG_ENTRY_HDR_SIZE + sizeof(union trace_rec)];
+
+    assert(len <= sizeof buf - LOG_ENTRY_HDR_SIZE);
+    memcpy(buf + LOG_ENTRY_HDR_SIZE, rec, len);
+    log_append(&trace_log, TRACE_LOG_MODULE, level, buf, len);
+}
+
+void
+trace_sample(int rc, uint16_t co2, uint16_t status)
+{
+    struct trace_sample ts;
+
+    ts.ts_type = TRACE_REC_SAMPLE;
+    ts.ts_rc = rc;
+    ts.ts_co2 = co2;
+    ts.ts_status = status;
+    trace_append(rc == 0 ? LOG_LEVEL_INFO : LOG_LEVEL_WARN, &ts, sizeof ts);
+}
+
+void
+trace_conn(int event, int status, const struct ble_gap_conn_desc *desc)
+{
+    struct trace_conn tc;
+
+    memset(&tc, 0, sizeof tc);
+    tc.tc_type = TRACE_REC_CONN;
+    tc.tc_event = event;
+    tc.tc_status = status;
+    if (desc == NULL) {
+        tc.tc_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    } else {
+        tc.tc_conn_handle = desc->conn_handle;
+        tc.tc_itvl = desc->conn_itvl;
+        tc.tc_latency = desc->conn_latency;
+        tc.tc_timeout = desc->supervision_timeout;
+        if (desc->sec_state.encrypted) {
+            tc.tc_flags |= TRACE_CONN_F_ENCRYPTED;
+        }
+        if (desc->sec_state.authenticated) {
+            tc.tc_flags |= TRACE_CONN_F_AUTHENTICATED;
+        }
+        if (desc->sec_state.bonded) {
+            tc.tc_flags |= TRACE_CONN_F_BONDED;
+        }
+        tc.tc_our_ota_addr_type = desc->our_ota_addr_type;
+        tc.tc_peer_ota_addr_type = desc->peer_ota_addr_type;
+        tc.tc_peer_id_addr_type = desc->peer_id_addr_type;
+        memcpy(tc.tc_our_ota_addr, desc->our_ota_addr, 6);
+        memcpy(tc.tc_peer_ota_addr, desc->peer_ota_addr, 6);
+        memcpy(tc.tc_peer_id_addr, desc->peer_id_addr, 6);
+    }
+    trace_append(LOG_LEVEL_INFO, &tc, sizeof tc);
+}
+
+static const char *
+trace_conn_event_name(int event)
+{
+    switch (event) {
+    case BLE_GAP_EVENT_CONNECT:
+        return "connect";
+    case BLE_GAP_EVENT_DISCONNECT:
+        return "disconnect";
+    case BLE_GAP_EVENT_CONN_UPDATE:
+        return "update";
+    case BLE_GAP_EVENT_ENC_CHANGE:
+        return "enc_change";
+    default:
+        return "?";
+    }
+}
+
+static void
+trace_print_addr(const char *name, uint8_t type, const uint8_t *addr)
+{
+    console_printf(" %s=%d/%02x:%02x:%02x:%02x:%02x:%02x", name, type,
+                   addr[5], addr[4], addr[3], addr[2], addr[1], addr[0]);
+}
+
+static void
+trace_print_conn(const struct trace_conn *tc)
+{
+    console_printf("conn %s status %d handle %d",
+                   trace_conn_event_name(tc->tc_event), tc->tc_status,
+                   tc->tc_conn_handle);
+    if (tc->tc_conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+        console_printf("\n");
+        return;
+    }
+    console_printf(" itvl %d latency %d timeout %d sec %c%c%c",
+                   tc->tc_itvl, tc->tc_latency, tc->tc_timeout,
+                   tc->tc_flags & TRACE_CONN_F_ENCRYPTED ? 'e' : '-',
+                   tc->tc_flags & TRACE_CONN_F_AUTHENTICATED ? 'a' : '-',
+                   tc->tc_flags & TRACE_CONN_F_BONDED ? 'b' : '-');
+    trace_print_addr("our_ota", tc->tc_our_ota_addr_type,
+                     tc->tc_our_ota_addr);
+    trace_print_addr("peer_ota", tc->tc_peer_ota_addr_type,
+                     tc->tc_peer_ota_addr);
+    trace_print_addr("peer_id", tc->tc_peer_id_addr_type,
+                     tc->tc_peer_id_addr);
+    console_printf("\n");
+}
+
+static int
+trace_print(struct log *log, void *arg, void *dptr, uint16_t len)
+{
+    struct log_entry_hdr ueh;
+    union trace_rec rec;
+    int rc;
+
+    rc = log_read(log, dptr, &ueh, 0, sizeof ueh);
+    if (rc != sizeof ueh) {
+        return 0;
+    }
+    memset(&rec, 0, sizeof rec);
+    len -= sizeof ueh;
+    if (len > sizeof rec) {
+        len = sizeof rec;
+    }
+    log_read(log, dptr, &rec, sizeof ueh, len);
+
+    console_printf("%lu %lu.%03lu ", (unsigned long)ueh.ue_index,
+                   (unsigned long)(ueh.ue_ts / 1000000),
+                   (unsigned long)(ueh.ue_ts / 1000 % 1000));
+    switch (rec.type) {
+    case TRACE_REC_SAMPLE:
+        if (rec.sample.ts_rc != 0) {
+            console_printf("sample error %d\n", rec.sample.ts_rc);
+        } else {
+            console_printf("sample co2 %d status 0x%04x\n",
+                           rec.sample.ts_co2, rec.sample.ts_status);
+        }
+        break;
+    case TRACE_REC_CONN:
+        trace_print_conn(&rec.conn);
+        break;
+    default:
+        console_printf("type %d len %d\n", rec.type, len);
+        break;
+    }
+    return 0;
+}
+
+static int
+trace_shell_func(int argc, char **argv)
+{
+    log_walk(&trace_log, trace_print, NULL);
+    return 0;
+}
+
+int
+trace_init(void)
+{
+    int rc;
+
+    cbmem_init(&trace_cbmem, trace_buf, sizeof trace_buf);
+    rc = log_register("trace", &trace_log, &log_cbmem_handler, &trace_cbmem,
+                      MYNEWT_VAL(AIRQ_TRACE_LEVEL));
+    if (rc != 0) {
+        return rc;
+    }
+    return shell_cmd_register(&trace_cmd);
+}
@@ -0,0 +1,89 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+*/
+
+#ifndef H_TRACE_
+#define H_TRACE_
+
+#include <inttypes.h>
+#include "log/log.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Binary event trace of sensor reads and connection events.  Fixed-size
+ * records go into a RAM log with a single append and are only formatted
+ * when the "trace" shell command asks for them, so neither the sampling
+ * path nor the host's GAP callback waits for text formatting or the UART.
+ * Records below AIRQ_TRACE_LEVEL are not kept.
+ */
+
+extern struct log trace_log;
+
+/* The trace uses the second "peruser" log module. */
+#define TRACE_LOG_MODULE        (LOG_MODULE_PERUSER + 1)
+
+#define TRACE_REC_SAMPLE        1
+#define TRACE_REC_CONN          2
+
+struct ble_gap_conn_desc;
+
+/* A sensor read: rc is 0, or the driver's negative error. */
+struct trace_sample {
+    uint8_t ts_type;
+    int8_t ts_rc;
+    uint16_t ts_co2;
+    uint16_t ts_status;
+};
+
+/*
+ * A GAP connection event: event is the BLE_GAP_EVENT_ type, status the
+ * event's status or disconnect reason.  Our identity address never
+ * changes, so it is left out.
+ */
+#define TRACE_CONN_F_ENCRYPTED      0x01
+#define TRACE_CONN_F_AUTHENTICATED  0x02
+#define TRACE_CONN_F_BONDED         0x04
+
+struct trace_conn {
+    uint8_t tc_type;
+    uint8_t tc_event;
+    int16_t tc_status;
+    uint16_t tc_conn_handle;
+    uint16_t tc_itvl;
+    uint16_t tc_latency;
+    uint16_t tc_timeout;
+    uint8_t tc_flags;
+    uint8_t tc_our_ota_addr_type;
+    uint8_t tc_peer_ota_addr_type;
+    uint8_t tc_peer_id_addr_type;
+    uint8_t tc_our_ota_addr[6];
+    uint8_t tc_peer_ota_addr[6];
+    uint8_t tc_peer_id_addr[6];
+};
+
+int trace_init(void);
+void trace_sample(int rc, uint16_t co2, uint16_t status);
+void trace_conn(int event, int status, const struct ble_gap_conn_desc *desc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,377 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "os/os.h"
+#include "syscfg/syscfg.h"
+#include "sysflash/sysflash.h"
+#include "flash_map/flash_map.h"
+#include "bootutil/image.h"
+#include "stats/stats.h"
+#include "mgmt/mgmt.h"
+#include "cborattr/cborattr.h"
+#include "bleprph.h"
+#include "connparam.h"
+#include "upgrade.h"
+
+#define UPGRADE_TIMEOUT_TICKS \
+    ((os_time_t)((uint64_t)MYNEWT_VAL(AIRQ_UPGRADE_TIMEOUT_MS) * \
+                 OS_TICKS_PER_SEC / 1000))
+
+STATS_SECT_START(upgrade_stats)
+    STATS_SECT_ENTRY(sessions)
+    STATS_SECT_ENTRY(timeouts)
+    STATS_SECT_ENTRY(bytes)
+    STATS_SECT_ENTRY(last_bytes)
+    STATS_SECT_ENTRY(last_ms)
+    STATS_SECT_ENTRY(last_rate)
+STATS_SECT_END
+
+STATS_SECT_DECL(upgrade_stats) upgrade_stats;
+
+STATS_NAME_START(upgrade_stats)
+    STATS_NAME(upgrade_stats, sessions)
+    STATS_NAME(upgrade_stats, timeouts)
+    STATS_NAME(upgrade_stats, bytes)
+    STATS_NAME(upgrade_stats, last_bytes)
+    STATS_NAME(upgrade_stats, last_ms)
+    STATS_NAME(upgrade_stats, last_rate)
+STATS_NAME_END(upgrade_stats)
+
+/* What the second slot holds: the image header and the last word of the
+ * image it describes.  An upload erases the slot and rewrites it from the
+ * start, so this changes by the time the last chunk is in.
+ */
+struct upgrade_slot {
+    struct image_header us_hdr;
+    uint32_t us_tail;
+};
+
+#define UPGRADE_OFF     0
+#define UPGRADE_TOOL    1   /* Started with the start command. */
+#define UPGRADE_AUTO    2   /* Started by newtmgr traffic. */
+
+static int upgrade_mode;
+static os_time_t upgrade_start_time;
+static os_time_t upgrade_last_time;
+static uint32_t upgrade_size;
+static struct os_callout upgrade_timer;
+
+/* Automatic sessions: the second slot as the session found it, and whether
+ * it has changed since, i.e. whether the traffic was an image upload.
+ */
+static struct upgrade_slot upgrade_slot_start;
+static int upgrade_slot_changed;
+
+static int upgrade_nmgr_state(struct mgmt_cbuf *cb);
+static int upgrade_nmgr_start(struct mgmt_cbuf *cb);
+static int upgrade_nmgr_stop(struct mgmt_cbuf *cb);
+
+#define UPGRADE_NMGR_ID_STATE   0
+#define UPGRADE_NMGR_ID_STOP    1
+
+static const struct mgmt_handler upgrade_nmgr_handlers[] = {
+    [UPGRADE_NMGR_ID_STATE] = { upgrade_nmgr_state, upgrade_nmgr_start },
+    [UPGRADE_NMGR_ID_STOP] = { NULL, upgrade_nmgr_stop },
+};
+
+static struct mgmt_group upgrade_nmgr_group = {
+    .mg_handlers = upgrade_nmgr_handlers,
+    .mg_handlers_count = sizeof(upgrade_nmgr_handlers) /
+                         sizeof(upgrade_nmgr_handlers[0]),
+    .mg_group_id = MYNEWT_VAL(AIRQ_UPGRADE_NMGR_GROUP),
+};
+
+/**
+ * Reads what the second slot holds; returns the size of its image, header
+ * and trailing TLVs included, as the header describes it, or 0 if there is
+ * none.
+ */
+static uint32_t
+upgrade_slot_read(struct upgrade_slot *us)
+{
+    const struct flash_area *fa;
+    uint32_t size;
+    int rc;
+
+    memset(us, 0, sizeof *us);
+    rc = flash_area_open(FLASH_AREA_IMAGE_1, &fa);
+    if (rc != 0) {
+        return 0;
+    }
+    size = 0;
+    rc = flash_area_read(fa, 0, &us->us_hdr, sizeof us->us_hdr);
+    if (rc == 0 && us->us_hdr.ih_magic == IMAGE_MAGIC) {
+        size = us->us_hdr.ih_hdr_size + us->us_hdr.ih_img_size +
+               us->us_hdr.ih_tlv_size;
+        if (size < sizeof us->us_tail || size > fa->fa_size) {
+            size = 0;
+        } else {
+            flash_area_read(fa, size - sizeof us->us_tail, &us->us_tail,
+                            sizeof us->us_tail);
+        }
+    }
+    flash_area_close(fa);
+    return size;
+}
+
+static uint32_t
+upgrade_image_size(void)
+{
+    struct upgrade_slot us;
+
+    return upgrade_slot_read(&us);
+}
+
+static uint32_t
+upgrade_elapsed_ms(os_time_t end)
+{
+    return (uint64_t)(end - upgrade_start_time) * 1000 / OS_TICKS_PER_SEC;
+}
+
+/**
+ * Ends the session and records its throughput.  The byte count is the
+ * size the tool announced, or failing that the size of the image now in
+ * the second slot.  An automatic session that never changed the second
+ * slot was other newtmgr traffic and is not recorded; it returns -1.
+ */
+static int
+upgrade_end(uint32_t *out_bytes, uint32_t *out_ms, uint32_t *out_rate)
+{
+    os_time_t end;
+    uint32_t bytes;
+    uint32_t rate;
+    uint32_t ms;
+    int mode;
+
+    if (upgrade_mode == UPGRADE_OFF) {
+        return -1;
+    }
+    os_callout_stop(&upgrade_timer);
+    mode = upgrade_mode;
+    upgrade_mode = UPGRADE_OFF;
+    if (mode == UPGRADE_TOOL) {
+        connparam_hold(0);
+        end = os_time_get();
+    } else {
+        if (!upgrade_slot_changed) {
+            return -1;
+        }
+        /* Leave out the quiet period that ended the session. */
+        end = upgrade_last_time;
+    }
+
+    ms = upgrade_elapsed_ms(end);
+    bytes = upgrade_size != 0 ? upgrade_size : upgrade_image_size();
+    rate = ms != 0 ? (uint64_t)bytes * 1000 / ms : 0;
+
+    STATS_INC(upgrade_stats, sessions);
+    STATS_INCN(upgrade_stats, bytes, bytes);
+    upgrade_stats.last_bytes = bytes;
+    upgrade_stats.last_ms = ms;
+    upgrade_stats.last_rate = rate;
+
+    BLEPRPH_LOG(INFO, "upgrade done; bytes=%lu ms=%lu rate=%lu B/s\n",
+                (unsigned long)bytes, (unsigned long)ms,
+                (unsigned long)rate);
+
+    if (out_bytes != NULL) {
+        *out_bytes = bytes;
+    }
+    if (out_ms != NULL) {
+        *out_ms = ms;
+    }
+    if (out_rate != NULL) {
+        *out_rate = rate;
+    }
+    return 0;
+}
+
+static void
+upgrade_timer_ev(struct os_event *ev)
+{
+    if (upgrade_mode == UPGRADE_OFF) {
+        return;
+    }
+    if (upgrade_mode == UPGRADE_TOOL) {
+        STATS_INC(upgrade_stats, timeouts);
+        BLEPRPH_LOG(INFO, "upgrade session timed out\n");
+    }
+    upgrade_end(NULL, NULL, NULL);
+}
+
+/**
+ * Starts an upload session; size is the number of bytes the tool is about
+ * to send, or 0 if unknown.  Starting again, or while an automatic session
+ * runs, restarts the measurement.
+ */
+int
+upgrade_start(uint32_t size)
+{
+    upgrade_mode = UPGRADE_TOOL;
+    upgrade_size = size;
+    upgrade_start_time = os_time_get();
+    upgrade_last_time = upgrade_start_time;
+    os_callout_reset(&upgrade_timer, UPGRADE_TIMEOUT_TICKS);
+    connparam_hold(1);
+
+    BLEPRPH_LOG(INFO, "upgrade started; size=%lu\n", (unsigned long)size);
+    return 0;
+}
+
+int
+upgrade_stop(void)
+{
+    if (upgrade_mode == UPGRADE_OFF) {
+        return -1;
+    }
+    return upgrade_end(NULL, NULL, NULL);
+}
+
+int
+upgrade_active(void)
+{
+    return upgrade_mode != UPGRADE_OFF;
+}
+
+/**
+ * Notes newtmgr traffic.  Without a session, this starts an automatic one,
+ * which becomes an image upload once the second slot changes under it; any
+ * session ends once newtmgr has been quiet for AIRQ_UPGRADE_TIMEOUT_MS.
+ */
+void
+upgrade_activity(void)
+{
+    struct upgrade_slot us;
+
+    upgrade_last_time = os_time_get();
+    if (upgrade_mode == UPGRADE_OFF) {
+        upgrade_mode = UPGRADE_AUTO;
+        upgrade_size = 0;
+        upgrade_start_time = upgrade_last_time;
+        upgrade_slot_read(&upgrade_slot_start);
+        upgrade_slot_changed = 0;
+    } else if (upgrade_mode == UPGRADE_AUTO && !upgrade_slot_changed) {
+        upgrade_slot_read(&us);
+        if (memcmp(&us, &upgrade_slot_start, sizeof us) != 0) {
+            upgrade_slot_changed = 1;
+            BLEPRPH_LOG(INFO, "image upload detected\n");
+        }
+    }
+    os_callout_reset(&upgrade_timer, UPGRADE_TIMEOUT_TICKS);
+}
+
+/**
+ * newtmgr read: the session state, with "ms" elapsed so far and "image"
+ * the size of the image in the second slot.
+ */
+static int
+upgrade_nmgr_state(struct mgmt_cbuf *cb)
+{
+    cbor_encode_text_stringz(&cb->encoder, "rc");
+    cbor_encode_int(&cb->encoder, MGMT_ERR_EOK);
+    cbor_encode_text_stringz(&cb->encoder, "active");
+    cbor_encode_boolean(&cb->encoder, upgrade_mode != UPGRADE_OFF);
+    cbor_encode_text_stringz(&cb->encoder, "ms");
+    cbor_encode_uint(&cb->encoder, upgrade_mode != UPGRADE_OFF ?
+                                   upgrade_elapsed_ms(os_time_get()) : 0);
+    cbor_encode_text_stringz(&cb->encoder, "image");
+    cbor_encode_uint(&cb->encoder, upgrade_image_size());
+    return 0;
+}
+
+/**
+ * newtmgr write: {"size": N} starts a session for an N byte image.
+ */
+static int
+upgrade_nmgr_start(struct mgmt_cbuf *cb)
+{
+    long long unsigned int size;
+    int rc;
+
+    const struct cbor_attr_t attrs[] = {
+        {
+            .attribute = "size",
+            .type = CborAttrUnsignedIntegerType,
+            .addr.uinteger = &size,
+            .nodefault = 1,
+        }, {
+            .attribute = NULL
+        }
+    };
+
+    size = 0;
+    rc = cbor_read_object(&cb->it, attrs);
+    if (rc != 0) {
+        return MGMT_ERR_EINVAL;
+    }
+
+    upgrade_start(size);
+    cbor_encode_text_stringz(&cb->encoder, "rc");
+    cbor_encode_int(&cb->encoder, MGMT_ERR_EOK);
+    return 0;
+}
+
+/**
+ * newtmgr write: ends the session and returns "bytes", "ms" and "rate" in
+ * bytes per second.
+ */
+static int
+upgrade_nmgr_stop(struct mgmt_cbuf *cb)
+{
+    uint32_t bytes;
+    uint32_t rate;
+    uint32_t ms;
+
+    if (upgrade_end(&bytes, &ms, &rate) != 0) {
+        return MGMT_ERR_EBADSTATE;
+    }
+
+    cbor_encode_text_stringz(&cb->encoder, "rc");
+    cbor_encode_int(&cb->encoder, MGMT_ERR_EOK);
+    cbor_encode_text_stringz(&cb->encoder, "bytes");
+    cbor_encode_uint(&cb->encoder, bytes);
+    cbor_encode_text_stringz(&cb->encoder, "ms");
+    cbor_encode_uint(&cb->encoder, ms);
+    cbor_encode_text_stringz(&cb->encoder, "rate");
+    cbor_encode_uint(&cb->encoder, rate);
+    return 0;
+}
+
+int
+upgrade_init(void)
+{
+    int rc;
+
+    os_callout_init(&upgrade_timer, os_eventq_dflt_get(), upgrade_timer_ev,
+                    NULL);
+
+    rc = stats_init(STATS_HDR(upgrade_stats),
+                    STATS_SIZE_INIT_PARMS(upgrade_stats, STATS_SIZE_32),
+                    STATS_NAME_INIT_PARMS(upgrade_stats));
+    if (rc != 0) {
+        return rc;
+    }
+    rc = stats_register("upgrade", STATS_HDR(upgrade_stats));
+    if (rc != 0) {
+        return rc;
+    }
+    return mgmt_group_register(&upgrade_nmgr_group);
+}
@@ -0,0 +1,50 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+*/
+
+#ifndef H_UPGRADE_
+#define H_UPGRADE_
+
+#include <inttypes.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Firmware upload session.  The image itself goes through the stock
+ * newtmgr image group, one chunk per request and response.  newtmgr
+ * traffic starts a session by itself, and it counts as an image upload
+ * once the second slot changes; its throughput is then kept in the
+ * "upgrade" statistics.  A tool can also bracket the upload with the
+ * "start" and "stop" commands of this group (see README.md), which
+ * additionally hold every connection on the bulk connection parameters.
+ * Either kind of session ends once newtmgr has been quiet for
+ * AIRQ_UPGRADE_TIMEOUT_MS.
+ */
+
+int upgrade_init(void);
+int upgrade_start(uint32_t size);
+int upgrade_stop(void);
+int upgrade_active(void);
+void upgrade_activity(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
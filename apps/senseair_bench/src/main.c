@@ -0,0 +1,261 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "sysinit/sysinit.h"
+#include "os/os.h"
+#include "os/os_cputime.h"
+#include "console/console.h"
+#include "senseair/senseair.h"
+#include "senseair/modbus.h"
+
+/*
+ * Each result is printed as one JSON object per line, prefixed with
+ * "BENCH " so it can be picked out of the console stream:
+ *
+ *     BENCH {"name":"mb_crc_nibble","bytes":1048576,"usecs":...}
+ *
+ * The rx parser and mb_crc_check() use whichever CRC variant the build
+ * selected, so their lines carry it in a "crc" field.
+ */
+
+#if MYNEWT_VAL(SENSEAIR_MB_CRC_TBL_256)
+#define BENCH_CRC_VARIANT   "byte256"
+#else
+#define BENCH_CRC_VARIANT   "nibble"
+#endif
+
+static uint8_t bench_buf[256];
+
+/*
+ * Largest response the driver asks for: IR1-IR6.
+ */
+static uint8_t bench_frame[17];
+
+static uint32_t
+bench_usecs(uint32_t start)
+{
+    return os_cputime_ticks_to_usecs(os_cputime_get32() - start);
+}
+
+static void
+bench_crc(const char *name,
+          uint16_t (*crc_fn)(const uint8_t *data, int len, uint16_t crc))
+{
+    uint32_t start;
+    uint32_t usecs;
+    uint32_t bytes;
+    volatile uint16_t crc;
+    int i;
+
+    bytes = MYNEWT_VAL(SENSEAIR_BENCH_CRC_KB) * 1024;
+    crc = 0xffff;
+    start = os_cputime_get32();
+    for (i = 0; i < bytes / sizeof(bench_buf); i++) {
+        crc = crc_fn(bench_buf, sizeof(bench_buf), crc);
+    }
+    usecs = bench_usecs(start);
+    if (usecs == 0) {
+        usecs = 1;
+    }
+
+    console_printf("BENCH {\"name\":\"%s\",\"bytes\":%lu,\"usecs\":%lu,"
+                   "\"bytes_per_sec\":%lu}\n", name,
+                   (unsigned long)bytes, (unsigned long)usecs,
+                   (unsigned long)((uint64_t)bytes * 1000000 / usecs));
+}
+
+static void
+bench_frame_init(void)
+{
+    uint16_t crc;
+    int i;
+
+    bench_frame[0] = 0xFE;
+    bench_frame[1] = 0x04;
+    bench_frame[2] = 12;
+    for (i = 3; i < 15; i++) {
+        bench_frame[i] = i;
+    }
+    crc = mb_crc(bench_frame, 15, 0xffff);
+    bench_frame[15] = crc & 0xff;
+    bench_frame[16] = crc >> 8;
+}
+
+/*
+ * Cost of validating a whole response frame at once.
+ */
+static void
+bench_crc_check(void)
+{
+    uint32_t start;
+    uint32_t usecs;
+    uint32_t bytes;
+    int frames;
+    int good;
+    int i;
+
+    frames = MYNEWT_VAL(SENSEAIR_BENCH_RX_FRAMES);
+    good = 0;
+    start = os_cputime_get32();
+    for (i = 0; i < frames; i++) {
+        if (mb_crc_check(bench_frame, sizeof(bench_frame)) == 0) {
+            good++;
+        }
+    }
+    usecs = bench_usecs(start);
+    if (usecs == 0) {
+        usecs = 1;
+    }
+    bytes = frames * sizeof(bench_frame);
+
+    console_printf("BENCH {\"name\":\"mb_crc_check\",\"crc\":\"%s\","
+                   "\"bytes\":%lu,\"usecs\":%lu,\"bytes_per_sec\":%lu,"
+                   "\"nsecs_per_frame\":%lu,\"frames\":%d,\"good\":%d}\n",
+                   BENCH_CRC_VARIANT, (unsigned long)bytes,
+                   (unsigned long)usecs,
+                   (unsigned long)((uint64_t)bytes * 1000000 / usecs),
+                   (unsigned long)((uint64_t)usecs * 1000 / frames),
+                   frames, good);
+}
+
+/*
+ * Per-byte cost of the UART rx path: the parser step plus the timestamp
+ * senseair_rx_char() takes for each byte.
+ */
+static void
+bench_rx(void)
+{
+    struct mb_parser mp;
+    uint32_t start;
+    uint32_t usecs;
+    uint32_t bytes;
+    int frames;
+    int good;
+    int i;
+    int j;
+
+    mb_parser_init(&mp, 0xFE, 0);
+    mb_parser_start(&mp, 0x04);
+
+    frames = MYNEWT_VAL(SENSEAIR_BENCH_RX_FRAMES);
+    good = 0;
+    start = os_cputime_get32();
+    for (i = 0; i < frames; i++) {
+        for (j = 0; j < sizeof(bench_frame); j++) {
+            if (mb_parser_feed(&mp, bench_frame[j], os_cputime_get32()) ==
+              MB_PARSE_FRAME) {
+                good++;
+            }
+        }
+    }
+    usecs = bench_usecs(start);
+    bytes = frames * sizeof(bench_frame);
+
+    console_printf("BENCH {\"name\":\"rx_byte\",\"crc\":\"%s\",\"bytes\":%lu,"
+                   "\"usecs\":%lu,\"nsecs_per_byte\":%lu,\"frames\":%d,"
+                   "\"good\":%d}\n", BENCH_CRC_VARIANT, (unsigned long)bytes,
+                   (unsigned long)usecs,
+                   (unsigned long)((uint64_t)usecs * 1000 / bytes),
+                   frames, good);
+}
+
+/*
+ * Request to response time of senseair_read_sample(), sensor included.
+ */
+static void
+bench_read(void)
+{
+    struct senseair_sample ss;
+    struct senseair *s;
+    uint32_t start;
+    uint32_t usecs;
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+    uint64_t sum = 0;
+    int reads;
+    int errs = 0;
+    int rc;
+    int i;
+
+    reads = MYNEWT_VAL(SENSEAIR_BENCH_READS);
+    if (reads == 0) {
+        return;
+    }
+    rc = senseair_init(MYNEWT_VAL(SENSEAIR_BENCH_UART), &s);
+    if (rc) {
+        console_printf("BENCH {\"name\":\"read\",\"error\":%d}\n", rc);
+        return;
+    }
+
+    for (i = 0; i < reads; i++) {
+        start = os_cputime_get32();
+        rc = senseair_read_sample(s, &ss);
+        usecs = bench_usecs(start);
+        if (rc) {
+            errs++;
+            continue;
+        }
+        sum += usecs;
+        if (usecs < min) {
+            min = usecs;
+        }
+        if (usecs > max) {
+            max = usecs;
+        }
+    }
+    if (errs == reads) {
+        min = 0;
+    }
+
+    console_printf("BENCH {\"name\":\"read\",\"reads\":%d,\"errors\":%d,"
+                   "\"min_usecs\":%lu,\"avg_usecs\":%lu,\"max_usecs\":%lu}\n",
+                   reads, errs, (unsigned long)min,
+                   (unsigned long)(errs == reads ? 0 : sum / (reads - errs)),
+                   (unsigned long)max);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    sysinit();
+
+    for (i = 0; i < sizeof(bench_buf); i++) {
+        bench_buf[i] = i * 7;
+    }
+    bench_frame_init();
+
+    bench_crc("mb_crc_nibble", mb_crc_nibble);
+#if MYNEWT_VAL(SENSEAIR_MB_CRC_TBL_256)
+    bench_crc("mb_crc_byte", mb_crc_byte);
+#endif
+    bench_crc_check();
+    bench_rx();
+    bench_read();
+    console_printf("BENCH {\"name\":\"done\"}\n");
+
+    while (1) {
+        os_eventq_run(os_eventq_dflt_get());
+    }
+
+    return 0;
+}
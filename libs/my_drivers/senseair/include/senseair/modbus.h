@@ -0,0 +1,74 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+*/
+#ifndef _SENSEAIR_MODBUS_H_
+#define _SENSEAIR_MODBUS_H_
+
+#include <stdint.h>
+#include "syscfg/syscfg.h"
+
+/*
+ * Modbus RTU framing, as spoken by the K30 on its UART.
+ */
+
+#define MB_FRAME_MAX            32
+
+/*
+ * Return values of mb_parser_feed().
+ */
+#define MB_PARSE_MORE           0       /* frame not complete yet */
+#define MB_PARSE_FRAME          1       /* good frame in mp_buf */
+#define MB_PARSE_EFRAME         -1      /* junk dropped, resyncing */
+#define MB_PARSE_ECRC           -2      /* complete frame with bad CRC */
+
+/*
+ * Streaming parser for Modbus RTU responses. Frame length is worked out
+ * from the function code and byte count as bytes come in, so responses
+ * of any length up to MB_FRAME_MAX are handled. Only responses to the
+ * request set with mb_parser_start() are accepted. After an error, or a
+ * gap of more than 3.5 characters, the parser hunts for the next frame
+ * start.
+ */
+struct mb_parser {
+    uint8_t mp_addr;            /* slave address to accept */
+    uint8_t mp_fn;              /* function code of the request, 0 = any */
+    uint8_t mp_off;             /* bytes in mp_buf */
+    uint8_t mp_len;             /* expected frame length, 0 if not known */
+    uint32_t mp_gap;            /* inter-frame gap, os_cputime ticks */
+    uint32_t mp_last;           /* time of previous byte */
+    uint16_t mp_crc;            /* CRC over mp_buf so far */
+    uint8_t mp_buf[MB_FRAME_MAX];
+};
+
+/*
+ * mb_crc() uses the table picked by SENSEAIR_MB_CRC_TBL_256. The variants
+ * are exported so they can be compared.
+ */
+uint16_t mb_crc(const uint8_t *data, int len, uint16_t crc);
+uint16_t mb_crc_nibble(const uint8_t *data, int len, uint16_t crc);
+#if MYNEWT_VAL(SENSEAIR_MB_CRC_TBL_256)
+uint16_t mb_crc_byte(const uint8_t *data, int len, uint16_t crc);
+#endif
+int mb_crc_check(const void *pkt, int len);
+
+void mb_parser_init(struct mb_parser *mp, uint8_t addr, uint32_t gap);
+void mb_parser_reset(struct mb_parser *mp);
+void mb_parser_start(struct mb_parser *mp, uint8_t fn);
+int mb_parser_feed(struct mb_parser *mp, uint8_t byte, uint32_t now);
+
+#endif /* _SENSEAIR_MODBUS_H_ */
@@ -19,12 +19,73 @@
 #ifndef _SENSEAIR_H_
 #define _SENSEAIR_H_
 
+#include <stdint.h>
+
 enum senseair_read_type {
         SENSEAIR_CO2,
+        SENSEAIR_ALL,           /* status, CO2 and, if fitted, temp/RH */
+};
+
+#define SENSEAIR_SAMPLE_F_STATUS        0x01
+#define SENSEAIR_SAMPLE_F_CO2           0x02
+#define SENSEAIR_SAMPLE_F_TEMP          0x04
+#define SENSEAIR_SAMPLE_F_HUMID         0x08
+
+/*
+ * Result of a read. ss_flags tells which fields were filled in; a
+ * SENSEAIR_ALL read gets all of them from one Modbus transaction.
+ */
+struct senseair_sample {
+    uint16_t ss_status;         /* meter status, 0 if all is well */
+    uint16_t ss_co2;            /* ppm */
+    int16_t ss_temp;            /* 0.01 degC */
+    uint16_t ss_humid;          /* 0.01 %RH */
+    uint8_t ss_flags;
 };
 
-int senseair_init(int uartno);
+struct os_eventq;
+
+/*
+ * One K30 sensor on its own UART. Each has its own command in flight, so
+ * reads on different sensors can overlap.
+ */
+struct senseair;
+
+/*
+ * Called with the result of senseair_read_async(). rc is 0 on success or
+ * negative on error: -2 on timeout, -3 on a malformed response or bad
+ * CRC, -4 if the sensor answered with a Modbus exception.
+ */
+typedef void senseair_read_cb(struct senseair *s, int rc,
+                              const struct senseair_sample *sample,
+                              void *arg);
+
+/*
+ * Sets up a sensor on UART uartno. The handle is returned through out.
+ * Up to SENSEAIR_MAX_DEVS sensors can be set up. Each gets a statistics
+ * section named "senseair<uartno>" with request outcomes and a latency
+ * histogram.
+ */
+int senseair_init(int uartno, struct senseair **out);
+
+struct senseair *senseair_get(int uartno);
+
+/*
+ * Blocking reads. senseair_read() returns the CO2 reading or a negative
+ * error; senseair_read_sample() does a SENSEAIR_ALL read.
+ */
+int senseair_read(struct senseair *s, enum senseair_read_type);
+int senseair_read_sample(struct senseair *s, struct senseair_sample *out);
+
+/*
+ * Starts a read and returns without waiting for the response. cb is
+ * called from the event queue set with senseair_evq_set() (default
+ * event queue unless set). Returns -1 if a read is already in progress
+ * on this sensor.
+ */
+int senseair_read_async(struct senseair *s, enum senseair_read_type type,
+                        senseair_read_cb *cb, void *arg);
 
-int senseair_read(enum senseair_read_type);
+void senseair_evq_set(struct senseair *s, struct os_eventq *evq);
 
 #endif /* _SENSEAIR_H_ */
@@ -0,0 +1,256 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#include <stdint.h>
+
+#include "syscfg/syscfg.h"
+#include "senseair/modbus.h"
+
+/*
+ * CRC for modbus over serial port.
+ */
+static const uint16_t mb_crc_tbl[] = {
+    0x0000, 0xcc01, 0xd801, 0x1400, 0xf001, 0x3c00, 0x2800, 0xe401,
+    0xa001, 0x6c00, 0x7800, 0xb401, 0x5000, 0x9c01, 0x8801, 0x4400
+};
+
+#if MYNEWT_VAL(SENSEAIR_MB_CRC_TBL_256)
+/*
+ * Byte-at-a-time table; one lookup per byte instead of two, for 480 more
+ * bytes of flash.
+ */
+static const uint16_t mb_crc_tbl_256[] = {
+    0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+    0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+    0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+    0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+    0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+    0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+    0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+    0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+    0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+    0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+    0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+    0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+    0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+    0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+    0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+    0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+    0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+    0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+    0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+    0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+    0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+    0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+    0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+    0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+    0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+    0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+    0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+    0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+    0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+    0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+    0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+    0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040
+};
+#endif
+
+static inline uint16_t
+mb_crc_update(uint16_t crc, uint8_t data)
+{
+#if MYNEWT_VAL(SENSEAIR_MB_CRC_TBL_256)
+    return (crc >> 8) ^ mb_crc_tbl_256[(crc ^ data) & 0xff];
+#else
+    crc ^= data;
+    crc = (crc >> 4) ^ mb_crc_tbl[crc & 0xf];
+    return (crc >> 4) ^ mb_crc_tbl[crc & 0xf];
+#endif
+}
+
+uint16_t
+mb_crc_nibble(const uint8_t *data, int len, uint16_t crc)
+{
+    while (len-- > 0) {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ mb_crc_tbl[crc & 0xf];
+        crc = (crc >> 4) ^ mb_crc_tbl[crc & 0xf];
+    }
+    return crc;
+}
+
+#if MYNEWT_VAL(SENSEAIR_MB_CRC_TBL_256)
+uint16_t
+mb_crc_byte(const uint8_t *data, int len, uint16_t crc)
+{
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ mb_crc_tbl_256[(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+#endif
+
+uint16_t
+mb_crc(const uint8_t *data, int len, uint16_t crc)
+{
+#if MYNEWT_VAL(SENSEAIR_MB_CRC_TBL_256)
+    return mb_crc_byte(data, len, crc);
+#else
+    return mb_crc_nibble(data, len, crc);
+#endif
+}
+
+int
+mb_crc_check(const void *pkt, int len)
+{
+    uint16_t crc, cmp;
+    uint8_t *bp = (uint8_t *)pkt;
+
+    if (len < sizeof(crc) + 1) {
+        return -1;
+    }
+    crc = mb_crc(pkt, len - 2, 0xffff);
+    cmp = bp[len - 2] | (bp[len - 1] << 8);
+    if (crc != cmp) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+/*
+ * Length of the response frame starting in buf, worked out from the
+ * function code (and byte count, when there is one). Returns 0 if more
+ * bytes are needed to tell, -1 for a function code we don't know.
+ */
+static int
+mb_frame_len(const uint8_t *buf, int off)
+{
+    uint8_t fn = buf[1];
+
+    if (fn & 0x80) {
+        /*
+         * Exception: addr, fn, code, crc.
+         */
+        return 5;
+    }
+    switch (fn) {
+    case 0x03:  /* read holding registers */
+    case 0x04:  /* read input registers */
+    case 0x44:  /* senseair read RAM */
+        if (off < 3) {
+            return 0;
+        }
+        return 5 + buf[2];
+    case 0x06:  /* write single register */
+    case 0x10:  /* write multiple registers */
+        return 8;
+    case 0x41:  /* senseair write RAM */
+        return 4;
+    default:
+        return -1;
+    }
+}
+
+void
+mb_parser_init(struct mb_parser *mp, uint8_t addr, uint32_t gap)
+{
+    mp->mp_addr = addr;
+    mp->mp_fn = 0;
+    mp->mp_gap = gap;
+    mp->mp_last = 0;
+    mb_parser_reset(mp);
+}
+
+void
+mb_parser_reset(struct mb_parser *mp)
+{
+    mp->mp_off = 0;
+    mp->mp_len = 0;
+    mp->mp_crc = 0xffff;
+}
+
+/*
+ * Gets ready for the response to a request with function code fn.
+ */
+void
+mb_parser_start(struct mb_parser *mp, uint8_t fn)
+{
+    mp->mp_fn = fn;
+    mb_parser_reset(mp);
+}
+
+int
+mb_parser_feed(struct mb_parser *mp, uint8_t byte, uint32_t now)
+{
+    int dropped = 0;
+    int len;
+    int rc;
+
+    if (mp->mp_off == 0) {
+        mp->mp_len = 0;
+    } else if (mp->mp_gap && (uint32_t)(now - mp->mp_last) > mp->mp_gap) {
+        /*
+         * Line went quiet mid-frame; what we had is junk.
+         */
+        mb_parser_reset(mp);
+        dropped = 1;
+    }
+    mp->mp_last = now;
+
+    if (mp->mp_off == 0 && mp->mp_addr && byte != mp->mp_addr) {
+        /*
+         * Hunting for the start of a frame.
+         */
+        return MB_PARSE_EFRAME;
+    }
+    if (mp->mp_off == 1 && mp->mp_fn &&
+      (byte & 0x7f) != mp->mp_fn) {
+        /*
+         * Not a response to our request; the address byte was junk. This
+         * byte may be the real start of frame.
+         */
+        if (byte != mp->mp_addr) {
+            mb_parser_reset(mp);
+        }
+        return MB_PARSE_EFRAME;
+    }
+    mp->mp_buf[mp->mp_off++] = byte;
+    mp->mp_crc = mb_crc_update(mp->mp_crc, byte);
+
+    if (mp->mp_len == 0 && mp->mp_off >= 2) {
+        len = mb_frame_len(mp->mp_buf, mp->mp_off);
+        if (len < 0 || len > MB_FRAME_MAX) {
+            mb_parser_reset(mp);
+            return MB_PARSE_EFRAME;
+        }
+        mp->mp_len = len;
+    }
+    if (mp->mp_len == 0 || mp->mp_off < mp->mp_len) {
+        return dropped ? MB_PARSE_EFRAME : MB_PARSE_MORE;
+    }
+
+    /*
+     * Frame complete. Leave mp_len and mp_buf for the caller to look at;
+     * they're cleared when the next byte comes in. Running the CRC over
+     * the frame's own CRC bytes leaves 0 if they match.
+     */
+    rc = mp->mp_crc == 0 ? MB_PARSE_FRAME : MB_PARSE_ECRC;
+    mp->mp_off = 0;
+    mp->mp_crc = 0xffff;
+    return rc;
+}
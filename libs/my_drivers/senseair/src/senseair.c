@@ -16,41 +16,146 @@
  * specific language governing permissions and limitations
  * under the License.
  */
+#include <assert.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 
 #include <shell/shell.h>
 #include <console/console.h>
 #include <os/os.h>
 
 #include <hal/hal_uart.h>
+#include <os/os_cputime.h>
+#include <stats/stats.h>
+#include <log/log.h>
+#include <cbmem/cbmem.h>
 
+#include "syscfg/syscfg.h"
 #include "senseair/senseair.h"
+#include "senseair/modbus.h"
+
+#define SENSEAIR_ADDR           0xFE
+#define SENSEAIR_BAUD           9600
 
 static const uint8_t cmd_read_co2[] = {
     0xFE, 0X44, 0X00, 0X08, 0X02, 0X9F, 0X25
 };
 
+/*
+ * Read input registers IR1-IR4 (status, alarm, output, CO2), or IR1-IR6
+ * on sensors that also have temperature and humidity.
+ */
+#if MYNEWT_VAL(SENSEAIR_RH_T)
+#define SENSEAIR_ALL_REGS       6
+static const uint8_t cmd_read_all[] = {
+    0xFE, 0x04, 0x00, 0x00, 0x00, 0x06, 0x64, 0x07
+};
+#else
+#define SENSEAIR_ALL_REGS       4
+static const uint8_t cmd_read_all[] = {
+    0xFE, 0x04, 0x00, 0x00, 0x00, 0x04, 0xE5, 0xC6
+};
+#endif
+
+/*
+ * Driver messages go to a RAM log, so a failing sensor costs no console
+ * output on the read path; "log" in newtmgr reads them back.
+ */
+static struct log senseair_log;
+static uint32_t senseair_log_buf[MYNEWT_VAL(SENSEAIR_LOG_BUF_SIZE) / 4];
+static struct cbmem senseair_log_cbmem;
+
+/*
+ * Messages below SENSEAIR_LOG_LEVEL, or below the system-wide LOG_LEVEL if
+ * that is higher, are compiled out, format string and arguments included.
+ */
+#define SENSEAIR_LOG(lvl, ...) do {                                         \
+    if (LOG_LEVEL_ ## lvl >= MYNEWT_VAL(SENSEAIR_LOG_LEVEL) &&              \
+      LOG_LEVEL_ ## lvl >= MYNEWT_VAL(LOG_LEVEL)) {                         \
+        log_printf(&senseair_log, MYNEWT_VAL(SENSEAIR_LOG_MODULE),          \
+          LOG_LEVEL_ ## lvl, __VA_ARGS__);                                  \
+    }                                                                       \
+} while (0)
+
 static int senseair_shell_func(int argc, char **argv);
 static struct shell_cmd senseair_cmd = {
     .sc_cmd = "senseair",
     .sc_cmd_func = senseair_shell_func,
 };
 
+/*
+ * Per-sensor statistics, registered as "senseair<uart>". Latency is from
+ * the start of the request to the last byte of the response, counted in
+ * the first bucket it is below.
+ */
+STATS_SECT_START(senseair_stats)
+    STATS_SECT_ENTRY(requests)
+    STATS_SECT_ENTRY(successes)
+    STATS_SECT_ENTRY(timeouts)
+    STATS_SECT_ENTRY(busy)
+    STATS_SECT_ENTRY(crc_errs)
+    STATS_SECT_ENTRY(exceptions)
+    STATS_SECT_ENTRY(resyncs)           /* bytes dropped hunting a frame */
+    STATS_SECT_ENTRY(lat_25ms)
+    STATS_SECT_ENTRY(lat_50ms)
+    STATS_SECT_ENTRY(lat_100ms)
+    STATS_SECT_ENTRY(lat_200ms)
+    STATS_SECT_ENTRY(lat_500ms)
+    STATS_SECT_ENTRY(lat_max_us)
+STATS_SECT_END
+
+STATS_NAME_START(senseair_stats)
+    STATS_NAME(senseair_stats, requests)
+    STATS_NAME(senseair_stats, successes)
+    STATS_NAME(senseair_stats, timeouts)
+    STATS_NAME(senseair_stats, busy)
+    STATS_NAME(senseair_stats, crc_errs)
+    STATS_NAME(senseair_stats, exceptions)
+    STATS_NAME(senseair_stats, resyncs)
+    STATS_NAME(senseair_stats, lat_25ms)
+    STATS_NAME(senseair_stats, lat_50ms)
+    STATS_NAME(senseair_stats, lat_100ms)
+    STATS_NAME(senseair_stats, lat_200ms)
+    STATS_NAME(senseair_stats, lat_500ms)
+    STATS_NAME(senseair_stats, lat_max_us)
+STATS_NAME_END(senseair_stats)
+
+/*
+ * Who is waiting for the response to the command in flight.
+ */
+#define SENSEAIR_WAIT_NONE      0
+#define SENSEAIR_WAIT_SEM       1
+#define SENSEAIR_WAIT_EVENT     2
+
 struct senseair { 
     int uart;
     struct os_sem sema;
     const uint8_t *tx_data;
     int tx_off;
     int tx_len;
-    uint8_t rx_data[32]; 
-    int rx_off;
-    int value;
-} senseair;
+    struct mb_parser rx;
+    enum senseair_read_type type;
+    int rc;
+    struct senseair_sample sample;
+    int wait;
+    struct os_eventq *evq;
+    struct os_event done_ev;
+    struct os_callout tmo;
+    senseair_read_cb *cb;
+    void *cb_arg;
+    uint32_t tx_start;
+    char stats_name[12];
+    STATS_SECT_DECL(senseair_stats) stats;
+};
+
+static struct senseair senseair_devs[MYNEWT_VAL(SENSEAIR_MAX_DEVS)];
+static int senseair_num_devs;
 
 static int
 senseair_tx_char(void *arg)
 {
-    struct senseair *s = &senseair;
+    struct senseair *s = (struct senseair *)arg;
     int rc;
 
     if (s->tx_off >= s->tx_len) {
@@ -67,40 +172,78 @@ senseair_tx_char(void *arg)
 }
 
 /*
- * CRC for modbus over serial port.
+ * Files the request to response time of the command in flight.
  */
-static const uint16_t mb_crc_tbl[] = {
-    0x0000, 0xcc01, 0xd801, 0x1400, 0xf001, 0x3c00, 0x2800, 0xe401,
-    0xa001, 0x6c00, 0x7800, 0xb401, 0x5000, 0x9c01, 0x8801, 0x4400
-};
+static void
+senseair_lat_add(struct senseair *s)
+{
+    uint32_t usecs;
+
+    usecs = os_cputime_ticks_to_usecs(os_cputime_get32() - s->tx_start);
+    if (usecs < 25000) {
+        STATS_INC(s->stats, lat_25ms);
+    } else if (usecs < 50000) {
+        STATS_INC(s->stats, lat_50ms);
+    } else if (usecs < 100000) {
+        STATS_INC(s->stats, lat_100ms);
+    } else if (usecs < 200000) {
+        STATS_INC(s->stats, lat_200ms);
+    } else {
+        STATS_INC(s->stats, lat_500ms);
+    }
+    if (usecs > s->stats.lat_max_us) {
+        s->stats.lat_max_us = usecs;
+    }
+}
 
 static uint16_t
-mb_crc(const uint8_t *data, int len, uint16_t crc)
+senseair_reg(const uint8_t *buf, int idx)
 {
-    while (len-- > 0) {
-        crc ^= *data++;
-        crc = (crc >> 4) ^ mb_crc_tbl[crc & 0xf];
-        crc = (crc >> 4) ^ mb_crc_tbl[crc & 0xf];
-    }
-    return crc;
+    return (buf[3 + idx * 2] << 8) | buf[4 + idx * 2];
 }
 
-static int
-mb_crc_check(const void *pkt, int len)
+/*
+ * Pulls the reading out of a good response frame.
+ */
+static void
+senseair_rx_frame(struct senseair *s)
 {
-    uint16_t crc, cmp;
-    uint8_t *bp = (uint8_t *)pkt;
+    const uint8_t *buf = s->rx.mp_buf;
+    struct senseair_sample *ss = &s->sample;
 
-    if (len < sizeof(crc) + 1) {
-        return -1;
+    memset(ss, 0, sizeof(*ss));
+    if (buf[1] & 0x80) {
+        /*
+         * Sensor rejected the command.
+         */
+        s->rc = -4;
+        return;
     }
-    crc = mb_crc(pkt, len - 2, 0xffff);
-    cmp = bp[len - 2] | (bp[len - 1] << 8);
-    if (crc != cmp) {
-        return -1;
-    } else {
-        return 0;
+    switch (s->type) {
+    case SENSEAIR_CO2:
+        if (buf[2] < 2) {
+            s->rc = -3;
+            return;
+        }
+        ss->ss_co2 = senseair_reg(buf, 0);
+        ss->ss_flags = SENSEAIR_SAMPLE_F_CO2;
+        break;
+    case SENSEAIR_ALL:
+        if (buf[2] < SENSEAIR_ALL_REGS * 2) {
+            s->rc = -3;
+            return;
+        }
+        ss->ss_status = senseair_reg(buf, 0);
+        ss->ss_co2 = senseair_reg(buf, 3);
+        ss->ss_flags = SENSEAIR_SAMPLE_F_STATUS | SENSEAIR_SAMPLE_F_CO2;
+#if MYNEWT_VAL(SENSEAIR_RH_T)
+        ss->ss_temp = (int16_t)senseair_reg(buf, 4);
+        ss->ss_humid = senseair_reg(buf, 5);
+        ss->ss_flags |= SENSEAIR_SAMPLE_F_TEMP | SENSEAIR_SAMPLE_F_HUMID;
+#endif
+        break;
     }
+    s->rc = 0;
 }
 
 static int
@@ -109,18 +252,53 @@ senseair_rx_char(void *arg, uint8_t data)
     struct senseair *s = (struct senseair *)arg;
     int rc;
 
-    if (s->rx_off >= sizeof(s->rx_data)) {
-        s->rx_off = 0;
+    rc = mb_parser_feed(&s->rx, data, os_cputime_get32());
+    switch (rc) {
+    case MB_PARSE_FRAME:
+        senseair_rx_frame(s);
+        break;
+    case MB_PARSE_ECRC:
+        /*
+         * crc error
+         */
+        s->rc = -3;
+        break;
+    case MB_PARSE_EFRAME:
+        STATS_INC(s->stats, resyncs);
+        return 0;
+    default:
+        return 0;
     }
-    s->rx_data[s->rx_off] = data;
-    s->rx_off++;
 
-    if (s->rx_off == 7) {
-        rc = mb_crc_check(s->rx_data, s->rx_off);
-        if (rc == 0) {
-            s->value = s->rx_data[3] * 256 + s->rx_data[4];
-            os_sem_release(&s->sema);
-        }
+    if (s->wait == SENSEAIR_WAIT_NONE) {
+        /*
+         * Late response to a command that already timed out.
+         */
+        return 0;
+    }
+    senseair_lat_add(s);
+    switch (s->rc) {
+    case 0:
+        STATS_INC(s->stats, successes);
+        break;
+    case -3:
+        STATS_INC(s->stats, crc_errs);
+        break;
+    case -4:
+        STATS_INC(s->stats, exceptions);
+        break;
+    }
+
+    switch (s->wait) {
+    case SENSEAIR_WAIT_SEM:
+        s->wait = SENSEAIR_WAIT_NONE;
+        os_sem_release(&s->sema);
+        break;
+    case SENSEAIR_WAIT_EVENT:
+        os_eventq_put(s->evq, &s->done_ev);
+        break;
+    default:
+        break;
     }
     return 0;
 }
@@ -131,95 +309,348 @@ senseair_tx(struct senseair *s, const uint8_t *tx_data, int data_len)
     s->tx_data = tx_data;
     s->tx_len = data_len;
     s->tx_off = 0;
-    s->rx_off = 0;
+    s->tx_start = os_cputime_get32();
+    mb_parser_start(&s->rx, tx_data[1]);
 
     hal_uart_start_tx(s->uart);
 }
 
-int
-senseair_read(enum senseair_read_type type)
+/*
+ * Claims the sensor for a new command, installing the completion callback
+ * of an asynchronous read along with it. Returns -1 if another command is
+ * still waiting for its response.
+ */
+static int
+senseair_start(struct senseair *s, enum senseair_read_type type, int wait,
+               senseair_read_cb *cb, void *cb_arg)
 {
-    struct senseair *s = &senseair;
     const uint8_t *cmd;
     int cmd_len;
-    int rc;
+    int sr;
 
-    if (s->tx_data) {
-        /*
-         * busy
-         */
-        return -1;
-    }
     switch (type) {
     case SENSEAIR_CO2:
         cmd = cmd_read_co2;
         cmd_len = sizeof(cmd_read_co2);
         break;
+    case SENSEAIR_ALL:
+        cmd = cmd_read_all;
+        cmd_len = sizeof(cmd_read_all);
+        break;
     default:
         return -1;
     }
+
+    OS_ENTER_CRITICAL(sr);
+    if (s->tx_data || s->wait != SENSEAIR_WAIT_NONE) {
+        OS_EXIT_CRITICAL(sr);
+        /*
+         * busy
+         */
+        STATS_INC(s->stats, busy);
+        return -1;
+    }
+    s->wait = wait;
+    s->cb = cb;
+    s->cb_arg = cb_arg;
+    OS_EXIT_CRITICAL(sr);
+
+    STATS_INC(s->stats, requests);
+
+    s->type = type;
+    if (wait == SENSEAIR_WAIT_EVENT) {
+        os_callout_reset(&s->tmo, OS_TICKS_PER_SEC / 2);
+    }
     senseair_tx(s, cmd, cmd_len);
+    return 0;
+}
+
+/*
+ * Blocks until the response to the command started with SENSEAIR_WAIT_SEM
+ * is in, or it times out.
+ */
+static int
+senseair_wait(struct senseair *s)
+{
+    int rc;
+    int sr;
+
     rc = os_sem_pend(&s->sema, OS_TICKS_PER_SEC / 2);
     if (rc == OS_TIMEOUT) {
+        OS_ENTER_CRITICAL(sr);
+        if (s->wait == SENSEAIR_WAIT_SEM) {
+            s->wait = SENSEAIR_WAIT_NONE;
+            OS_EXIT_CRITICAL(sr);
+            /*
+             * timeout
+             */
+            STATS_INC(s->stats, timeouts);
+            SENSEAIR_LOG(DEBUG, "read timed out; uart=%d\n", s->uart);
+            return -2;
+        }
+        OS_EXIT_CRITICAL(sr);
         /*
-         * timeout
+         * Response came in just as we timed out; consume the release.
          */
-        return -2;
+        os_sem_pend(&s->sema, 0);
+    }
+    return s->rc;
+}
+
+int
+senseair_read(struct senseair *s, enum senseair_read_type type)
+{
+    int rc;
+
+    rc = senseair_start(s, type, SENSEAIR_WAIT_SEM, NULL, NULL);
+    if (rc) {
+        return rc;
+    }
+    rc = senseair_wait(s);
+    if (rc) {
+        return rc;
     }
-    return s->value;
+    return s->sample.ss_co2;
+}
+
+int
+senseair_read_sample(struct senseair *s, struct senseair_sample *out)
+{
+    int rc;
+
+    rc = senseair_start(s, SENSEAIR_ALL, SENSEAIR_WAIT_SEM, NULL, NULL);
+    if (rc) {
+        return rc;
+    }
+    rc = senseair_wait(s);
+    if (rc) {
+        return rc;
+    }
+    *out = s->sample;
+    return 0;
+}
+
+/*
+ * Ends the asynchronous read in progress and hands back its callback.
+ * Called with interrupts disabled, so a new read cannot claim the sensor
+ * before this one has let go of its timer, event and callback.
+ */
+static void
+senseair_release(struct senseair *s, senseair_read_cb **cb, void **cb_arg)
+{
+    s->wait = SENSEAIR_WAIT_NONE;
+    os_callout_stop(&s->tmo);
+    os_eventq_remove(s->evq, &s->done_ev);
+    *cb = s->cb;
+    *cb_arg = s->cb_arg;
+    s->cb = NULL;
+}
+
+/*
+ * Finishes an asynchronous read; runs in the context of the task
+ * processing senseair's event queue.
+ */
+static void
+senseair_finish(struct senseair *s, int rc, senseair_read_cb *cb,
+                void *cb_arg)
+{
+    if (rc) {
+        SENSEAIR_LOG(DEBUG, "read failed; uart=%d rc=%d\n", s->uart, rc);
+    }
+    cb(s, rc, &s->sample, cb_arg);
+}
+
+static void
+senseair_done_ev(struct os_event *ev)
+{
+    struct senseair *s = ev->ev_arg;
+    senseair_read_cb *cb;
+    void *cb_arg;
+    int rc;
+    int sr;
+
+    OS_ENTER_CRITICAL(sr);
+    if (s->wait != SENSEAIR_WAIT_EVENT) {
+        OS_EXIT_CRITICAL(sr);
+        return;
+    }
+    rc = s->rc;
+    senseair_release(s, &cb, &cb_arg);
+    OS_EXIT_CRITICAL(sr);
+
+    senseair_finish(s, rc, cb, cb_arg);
+}
+
+static void
+senseair_tmo_ev(struct os_event *ev)
+{
+    struct senseair *s = ev->ev_arg;
+    senseair_read_cb *cb;
+    void *cb_arg;
+    int sr;
+
+    /*
+     * If the response got in before the timer fired, its done_ev is
+     * queued and completes the read; don't count it as a timeout too.
+     * Releasing the sensor here makes rx_char treat anything later as late.
+     */
+    OS_ENTER_CRITICAL(sr);
+    if (s->wait != SENSEAIR_WAIT_EVENT || OS_EVENT_QUEUED(&s->done_ev)) {
+        OS_EXIT_CRITICAL(sr);
+        return;
+    }
+    senseair_release(s, &cb, &cb_arg);
+    OS_EXIT_CRITICAL(sr);
+
+    STATS_INC(s->stats, timeouts);
+    senseair_finish(s, -2, cb, cb_arg);
+}
+
+int
+senseair_read_async(struct senseair *s, enum senseair_read_type type,
+                    senseair_read_cb *cb, void *arg)
+{
+    if (!cb || !s->evq) {
+        return -1;
+    }
+    return senseair_start(s, type, SENSEAIR_WAIT_EVENT, cb, arg);
+}
+
+void
+senseair_evq_set(struct senseair *s, struct os_eventq *evq)
+{
+    s->evq = evq;
+    s->done_ev.ev_cb = senseair_done_ev;
+    s->done_ev.ev_arg = s;
+    os_callout_init(&s->tmo, evq, senseair_tmo_ev, s);
+}
+
+struct senseair *
+senseair_get(int uartno)
+{
+    int i;
+
+    for (i = 0; i < senseair_num_devs; i++) {
+        if (senseair_devs[i].uart == uartno) {
+            return &senseair_devs[i];
+        }
+    }
+    return NULL;
 }
 
 static int
 senseair_shell_func(int argc, char **argv)
 {
+    struct senseair *s;
+    struct senseair_sample ss;
     int value;
-    enum senseair_read_type type;
+    int uartno;
+    int rc;
 
-    if (argc < 2) {
-usage:
-        console_printf("%s co2\n", argv[0]);
+    if (argc < 2 ||
+      (strcmp(argv[1], "co2") && strcmp(argv[1], "all"))) {
+        console_printf("%s co2|all [uart]\n", argv[0]);
         return 0;
     }
-    if (!strcmp(argv[1], "co2")) {
-        type = SENSEAIR_CO2;
+    if (argc > 2) {
+        uartno = atoi(argv[2]);
+        s = senseair_get(uartno);
     } else {
-        goto usage;
+        s = senseair_num_devs ? &senseair_devs[0] : NULL;
     }
-    value = senseair_read(type);
-    if (value >= 0) {
-        console_printf("Got %d\n", value);
-    } else {
-        console_printf("Error while reading: %d\n", value);
+    if (!s) {
+        console_printf("No sensor\n");
+        return 0;
+    }
+    if (!strcmp(argv[1], "co2")) {
+        value = senseair_read(s, SENSEAIR_CO2);
+        if (value >= 0) {
+            console_printf("Got %d\n", value);
+        } else {
+            console_printf("Error while reading: %d\n", value);
+        }
+        return 0;
+    }
+    rc = senseair_read_sample(s, &ss);
+    if (rc) {
+        console_printf("Error while reading: %d\n", rc);
+        return 0;
     }
+    console_printf("status 0x%04x co2 %d", ss.ss_status, ss.ss_co2);
+    if (ss.ss_flags & SENSEAIR_SAMPLE_F_TEMP) {
+        console_printf(" temp %d", ss.ss_temp);
+    }
+    if (ss.ss_flags & SENSEAIR_SAMPLE_F_HUMID) {
+        console_printf(" humid %d", ss.ss_humid);
+    }
+    console_printf("\n");
     return 0;
 }
 
 int
-senseair_init(int uartno)
+senseair_init(int uartno, struct senseair **out)
 {
     int rc;
-    struct senseair *s = &senseair;
+    struct senseair *s;
 
-    rc = shell_cmd_register(&senseair_cmd);
+    if (senseair_get(uartno)) {
+        return -1;
+    }
+    if (senseair_num_devs >= MYNEWT_VAL(SENSEAIR_MAX_DEVS)) {
+        return -1;
+    }
+    s = &senseair_devs[senseair_num_devs];
+    memset(s, 0, sizeof(*s));
+
+    snprintf(s->stats_name, sizeof(s->stats_name), "senseair%d", uartno);
+    rc = stats_init(STATS_HDR(s->stats),
+      STATS_SIZE_INIT_PARMS(s->stats, STATS_SIZE_32),
+      STATS_NAME_INIT_PARMS(senseair_stats));
     if (rc) {
         return rc;
     }
 
-    rc = os_sem_init(&s->sema, 1);
+    rc = os_sem_init(&s->sema, 0);
     if (rc) {
         return rc;
     }
+    /*
+     * Frames are separated by 3.5 characters of silence (11 bits each).
+     */
+    mb_parser_init(&s->rx, SENSEAIR_ADDR,
+      os_cputime_usecs_to_ticks(35 * 11 * 100000 / SENSEAIR_BAUD));
+    senseair_evq_set(s, os_eventq_dflt_get());
     rc = hal_uart_init_cbs(uartno, senseair_tx_char, NULL,
-      senseair_rx_char, &senseair);
+      senseair_rx_char, s);
     if (rc) {
         return rc;
     }
-    rc = hal_uart_config(uartno, 9600, 8, 1, HAL_UART_PARITY_NONE,
+    rc = hal_uart_config(uartno, SENSEAIR_BAUD, 8, 1, HAL_UART_PARITY_NONE,
       HAL_UART_FLOW_CTL_NONE);
     if (rc) {
         return rc;
     }
+
+    /*
+     * Register with the system only once the UART is set up, so an init
+     * that is retried after an error does not register twice.
+     */
+    if (senseair_num_devs == 0) {
+        cbmem_init(&senseair_log_cbmem, senseair_log_buf,
+          sizeof(senseair_log_buf));
+        log_register("senseair", &senseair_log, &log_cbmem_handler,
+          &senseair_log_cbmem, LOG_SYSLEVEL);
+        rc = shell_cmd_register(&senseair_cmd);
+        assert(rc == 0);
+    }
+    rc = stats_register(s->stats_name, STATS_HDR(s->stats));
+    assert(rc == 0);
+
     s->uart = uartno;
+    senseair_num_devs++;
 
+    if (out) {
+        *out = s;
+    }
     return 0;
 }
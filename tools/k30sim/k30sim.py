@@ -0,0 +1,268 @@
+#!/usr/bin/env python3
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+"""SenseAir K30 emulator for the native build of the beacon.
+
+Answers the Modbus RTU requests the senseair driver sends: 0x44 (read
+RAM, CO2 at 0x0008) and 0x04 (read input registers IR1-IR6). Values come
+from a script file or a random walk; reply latency and line faults can
+be injected.
+
+    newt run airq_native          # prints "uart1 at /dev/pts/N"
+    tools/k30sim/k30sim.py /dev/pts/N --latency 20 --corrupt 0.01
+
+With --pty the emulator makes its own pseudo-terminal and prints the
+name, for builds that open a given device instead.
+"""
+
+import argparse
+import os
+import random
+import select
+import signal
+import sys
+import termios
+import time
+import tty
+
+ADDR = 0xFE
+BAUD = 9600
+CHAR_TIME = 11.0 / BAUD             # seconds per character on the wire
+FRAME_GAP = 3.5 * CHAR_TIME
+
+
+def mb_crc(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            if crc & 1:
+                crc = (crc >> 1) ^ 0xA001
+            else:
+                crc >>= 1
+    return crc
+
+
+def with_crc(data):
+    crc = mb_crc(data)
+    return bytes(data) + bytes([crc & 0xFF, crc >> 8])
+
+
+class Sensor(object):
+    """Register contents of the emulated sensor."""
+
+    def __init__(self, args, rng):
+        self.rng = rng
+        self.script = None
+        self.script_pos = 0
+        if args.script:
+            with open(args.script) as f:
+                self.script = [int(l.split()[0]) for l in f
+                               if l.strip() and not l.startswith('#')]
+        self.co2 = args.co2
+        self.noise = args.noise
+        self.status = args.status
+        self.temp = int(args.temp * 100)
+        self.humid = int(args.humid * 100)
+
+    def sample(self):
+        """Advances to the next CO2 value."""
+        if self.script:
+            self.co2 = self.script[self.script_pos % len(self.script)]
+            self.script_pos += 1
+        elif self.noise:
+            self.co2 += self.rng.randint(-self.noise, self.noise)
+            self.co2 = max(0, min(10000, self.co2))
+        return self.co2
+
+    def input_reg(self, idx):
+        regs = {
+            0: self.status,         # IR1 meter status
+            1: 0,                   # IR2 alarm status
+            2: 0,                   # IR3 output status
+            3: self.co2,            # IR4 space CO2
+            4: self.temp & 0xFFFF,  # IR5 space temperature, K33
+            5: self.humid,          # IR6 space humidity, K33
+        }
+        return regs.get(idx)
+
+
+class Emulator(object):
+    def __init__(self, fd, args):
+        self.fd = fd
+        self.args = args
+        self.rng = random.Random(args.seed)
+        self.sensor = Sensor(args, self.rng)
+        self.rx = bytearray()
+        self.stats = dict(requests=0, replies=0, bad_requests=0,
+                          dropped=0, corrupted=0, garbage=0, split=0,
+                          exceptions=0)
+
+    def log(self, msg):
+        if self.args.verbose:
+            sys.stderr.write('%.3f %s\n' % (time.time(), msg))
+
+    def chance(self, p):
+        return p > 0 and self.rng.random() < p
+
+    def response(self, req):
+        fn = req[1]
+        if self.chance(self.args.exception):
+            self.stats['exceptions'] += 1
+            return with_crc([ADDR, fn | 0x80, 0x04])
+        if fn == 0x44 and len(req) == 7:
+            addr = (req[2] << 8) | req[3]
+            if addr != 0x0008 or req[4] != 2:
+                return with_crc([ADDR, fn | 0x80, 0x02])
+            co2 = self.sensor.sample()
+            return with_crc([ADDR, fn, 2, co2 >> 8, co2 & 0xFF])
+        if fn == 0x04 and len(req) == 8:
+            start = (req[2] << 8) | req[3]
+            count = (req[4] << 8) | req[5]
+            self.sensor.sample()
+            body = []
+            for i in range(start, start + count):
+                v = self.sensor.input_reg(i)
+                if v is None:
+                    return with_crc([ADDR, fn | 0x80, 0x02])
+                body += [v >> 8, v & 0xFF]
+            return with_crc([ADDR, fn, len(body)] + body)
+        return with_crc([ADDR, fn | 0x80, 0x01])
+
+    def send(self, frame):
+        args = self.args
+        if self.chance(args.drop):
+            self.stats['dropped'] += 1
+            self.log('drop')
+            return
+        frame = bytearray(frame)
+        if self.chance(args.corrupt):
+            self.stats['corrupted'] += 1
+            frame[self.rng.randrange(len(frame))] ^= 1 << self.rng.randrange(8)
+            self.log('corrupt')
+        if self.chance(args.garbage):
+            self.stats['garbage'] += 1
+            junk = bytes(self.rng.randrange(256)
+                         for _ in range(self.rng.randint(1, 4)))
+            os.write(self.fd, junk)
+            self.log('garbage %s' % junk.hex())
+        if self.chance(args.split):
+            self.stats['split'] += 1
+            cut = self.rng.randint(1, len(frame) - 1)
+            os.write(self.fd, bytes(frame[:cut]))
+            time.sleep(FRAME_GAP * 2)
+            frame = frame[cut:]
+            self.log('split at %d' % cut)
+        os.write(self.fd, bytes(frame))
+        self.stats['replies'] += 1
+
+    def handle(self, req):
+        self.stats['requests'] += 1
+        if len(req) < 4 or req[0] != ADDR or mb_crc(req) != 0:
+            self.stats['bad_requests'] += 1
+            self.log('bad request %s' % bytes(req).hex())
+            return
+        rsp = self.response(req)
+        delay = self.args.latency / 1000.0
+        if self.args.jitter:
+            delay += self.rng.uniform(0, self.args.jitter / 1000.0)
+        # Wire time of the reply, as a real 9600 baud line would have.
+        delay += len(rsp) * CHAR_TIME
+        time.sleep(delay)
+        self.log('req %s rsp %s' % (bytes(req).hex(), rsp.hex()))
+        self.send(rsp)
+
+    def run(self):
+        while True:
+            timeout = FRAME_GAP if self.rx else None
+            r, _, _ = select.select([self.fd], [], [], timeout)
+            if not r:
+                # End of request frame.
+                req, self.rx = bytes(self.rx), bytearray()
+                self.handle(req)
+                continue
+            try:
+                data = os.read(self.fd, 64)
+            except OSError:
+                # Peer closed the pty; wait for it to come back.
+                time.sleep(0.1)
+                continue
+            self.rx += data
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    p.add_argument('device', nargs='?',
+                   help='tty of the sensor UART, e.g. /dev/pts/N')
+    p.add_argument('--pty', action='store_true',
+                   help='create a pseudo-terminal and print its name')
+    p.add_argument('--co2', type=int, default=450, help='initial CO2 ppm')
+    p.add_argument('--noise', type=int, default=5,
+                   help='random walk step in ppm per sample, 0 for constant')
+    p.add_argument('--script', help='file with one CO2 ppm value per line')
+    p.add_argument('--status', type=int, default=0, help='meter status')
+    p.add_argument('--temp', type=float, default=21.5, help='degC')
+    p.add_argument('--humid', type=float, default=40.0, help='%%RH')
+    p.add_argument('--latency', type=float, default=15.0,
+                   help='sensor turnaround in ms')
+    p.add_argument('--jitter', type=float, default=0.0,
+                   help='random extra turnaround, up to this many ms')
+    p.add_argument('--drop', type=float, default=0.0,
+                   help='probability of not answering')
+    p.add_argument('--corrupt', type=float, default=0.0,
+                   help='probability of flipping a bit in the reply')
+    p.add_argument('--garbage', type=float, default=0.0,
+                   help='probability of junk bytes before the reply')
+    p.add_argument('--split', type=float, default=0.0,
+                   help='probability of a frame gap inside the reply')
+    p.add_argument('--exception', type=float, default=0.0,
+                   help='probability of a Modbus exception reply')
+    p.add_argument('--seed', type=int, default=None,
+                   help='random seed, for reproducible runs')
+    p.add_argument('-v', '--verbose', action='store_true')
+    args = p.parse_args()
+
+    if args.pty:
+        master, slave = os.openpty()
+        tty.setraw(slave)
+        print(os.ttyname(slave), flush=True)
+        fd = master
+    elif args.device:
+        fd = os.open(args.device, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(fd)
+        attrs = termios.tcgetattr(fd)
+        attrs[4] = attrs[5] = termios.B9600
+        termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    else:
+        p.error('need a device or --pty')
+
+    emu = Emulator(fd, args)
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+    try:
+        emu.run()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        sys.stderr.write(' '.join('%s=%d' % kv
+                                  for kv in sorted(emu.stats.items())) + '\n')
+
+
+if __name__ == '__main__':
+    main()
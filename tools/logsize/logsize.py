@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+"""Image size of a target at each compile-time log threshold.
+
+Builds a copy of the target per threshold, with BLEPRPH_LOG_LEVEL,
+SENSEAIR_LOG_LEVEL and the core LOG_LEVEL (which filters the NimBLE
+host's ble_hs messages) all set to it, and prints flash and RAM use
+against the first one. "default" builds the target as it is. Run from
+the project root:
+
+    tools/logsize/logsize.py primoairqbeacon --levels default,0,1,3,255
+"""
+
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+SETTINGS = ('BLEPRPH_LOG_LEVEL', 'SENSEAIR_LOG_LEVEL', 'LOG_LEVEL')
+
+
+def make_target(base, name, level):
+    """Copies targets/<base> to targets/<name> with the thresholds set,
+    or left alone if level is None."""
+    src = os.path.join('targets', base)
+    dst = os.path.join('targets', name)
+    if os.path.exists(dst):
+        shutil.rmtree(dst)
+    shutil.copytree(src, dst)
+
+    path = os.path.join(dst, 'pkg.yml')
+    with open(path) as f:
+        text = f.read()
+    text = text.replace('targets/%s' % base, 'targets/%s' % name)
+    with open(path, 'w') as f:
+        f.write(text)
+
+    if level is None:
+        return dst
+
+    path = os.path.join(dst, 'syscfg.yml')
+    lines = []
+    if os.path.exists(path):
+        with open(path) as f:
+            lines = [l for l in f
+                     if not re.match(r'\s+(%s):' % '|'.join(SETTINGS), l)]
+    if not any(l.startswith('syscfg.vals:') for l in lines):
+        lines.append('syscfg.vals:\n')
+    with open(path, 'w') as f:
+        for l in lines:
+            f.write(l)
+            if l.startswith('syscfg.vals:'):
+                for s in SETTINGS:
+                    f.write('    %s: %d\n' % (s, level))
+    return dst
+
+
+def elf_path(target):
+    with open(os.path.join('targets', target, 'target.yml')) as f:
+        app = re.search(r'target\.app:\s*"?([^"\s]+)', f.read()).group(1)
+    app = app.split('/', 1)[1] if app.startswith('@') else app
+    return os.path.join('bin', 'targets', target, 'app', app,
+                        os.path.basename(app) + '.elf')
+
+
+def image_size(size_tool, elf):
+    out = subprocess.check_output([size_tool, elf]).decode()
+    text, data, bss = [int(v) for v in out.splitlines()[1].split()[:3]]
+    return text + data, data + bss
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    p.add_argument('target', nargs='?', default='primoairqbeacon')
+    p.add_argument('--levels', default='default,0,1,2,3,255',
+                   help='comma separated thresholds, first is the baseline')
+    p.add_argument('--size-tool', default='arm-none-eabi-size',
+                   help='binutils size for the target, "size" for native')
+    p.add_argument('--keep', action='store_true',
+                   help='leave the generated targets in place')
+    args = p.parse_args()
+
+    levels = [None if l == 'default' else int(l)
+              for l in args.levels.split(',')]
+    rows = []
+    for level in levels:
+        name = '%s_log%s' % (args.target,
+                             'default' if level is None else level)
+        dst = make_target(args.target, name, level)
+        try:
+            subprocess.check_call(['newt', 'build', name],
+                                  stdout=subprocess.DEVNULL)
+            rows.append((level,) + image_size(args.size_tool,
+                                              elf_path(name)))
+        finally:
+            if not args.keep:
+                shutil.rmtree(dst)
+
+    base_flash, base_ram = rows[0][1], rows[0][2]
+    print('%-7s %10s %8s %10s %8s' % ('level', 'flash', 'delta', 'ram',
+                                      'delta'))
+    for level, flash, ram in rows:
+        print('%-7s %10d %+8d %10d %+8d' % ('default' if level is None
+                                            else level,
+                                            flash, flash - base_flash,
+                                            ram, ram - base_ram))
+
+
+if __name__ == '__main__':
+    sys.exit(main())